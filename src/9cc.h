@@ -3,11 +3,20 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 typedef struct Type Type;
 typedef struct Member Member;
@@ -17,47 +26,155 @@ typedef struct Member Member;
 //
 
 // トークンの種類
+// 予約語と区切り文字は、字句解析の時点でそれぞれ固有の種類に分類する
 typedef enum {
-  TK_RESERVED,  // キーワード or 区切り文字(符号など)
-  TK_IDENT,     // 識別子(変数や関数など)
+  TK_IDENT,  // 識別子(変数や関数など)
   TK_STR,  // 文字列リテラル(数値や文字列を直接に記述した定数のこと)
   TK_NUM,  // 整数トークン
   TK_EOF,  // 入力の終わりを表すトークン
+
+  // 予約語
+  TK_RETURN,  // "return"
+  TK_IF,      // "if"
+  TK_ELSE,    // "else"
+  TK_WHILE,   // "while"
+  TK_FOR,     // "for"
+  TK_INT,     // "int"
+  TK_CHAR,    // "char"
+  TK_SHORT,   // "short"
+  TK_LONG,    // "long"
+  TK_SIZEOF,  // "sizeof"
+  TK_STRUCT,  // "struct"
+
+  // 区切り文字
+  TK_EQ,        // ==
+  TK_NE,        // !=
+  TK_LE,        // <=
+  TK_GE,        // >=
+  TK_LT,        // <
+  TK_GT,        // >
+  TK_ASSIGN,    // =
+  TK_PLUS,      // +
+  TK_MINUS,     // -
+  TK_STAR,      // *
+  TK_SLASH,     // /
+  TK_AMP,       // &
+  TK_LPAREN,    // (
+  TK_RPAREN,    // )
+  TK_LBRACE,    // {
+  TK_RBRACE,    // }
+  TK_LBRACKET,  // [
+  TK_RBRACKET,  // ]
+  TK_SEMI,      // ;
+  TK_COMMA,     // ,
+  TK_DOT,       // .
 } TokenKind;
 
-// トークン型
-typedef struct Token Token;
-struct Token {
-  TokenKind kind;  // トークンの型
-  Token *next;     // 次の入力トークン
-  int val;         // kindがTK_NUMの場合、その数値
-  char *str;       // トークン文字列
-  int len;         // トークンの長さ
-
-  char *contents;  // 終端を含む文字列リテラルの内容 '\0'
-  char cont_len;   // string literal length
-};
+// トークン。下位32ビットはトークン列の中の番号(0番は無効なトークンとして予約)、
+// 上位32ビットはトークン文字列のuser_inputからのオフセット。
+// 位置はトークン列から追い出された後でも(エラー報告に)使える
+typedef uint64_t Token;
+
+// 文字列リテラル
+typedef struct {
+  char *contents;  // 文字列リテラルの内容。終端の'\0'は含まない
+  int cont_len;    // 終端の'\0'を含む長さ
+} StrLit;
+
+// トークンの値
+typedef union {
+  long num;     // kindがTK_NUMの場合、その数値
+  StrLit *str;  // kindがTK_STRの場合、その内容
+  char *ident;  // kindがTK_IDENTの場合、internされた名前
+} TokenVal;
+
+// トークン列。各トークンの種類・位置・長さ・値を別々の配列に並べて持つ
+// --stream-lexの場合は、構文解析が必要とした分だけ字句解析を進める
+// リングバッファとして使い、トークンの番号をmaskでビット積して添字にする
+typedef struct {
+  unsigned char *kind;  // トークンの型(TokenKind)
+  uint32_t *loc;        // トークン文字列のuser_inputからのオフセット
+  uint32_t *len;        // トークンの長さ
+  TokenVal *val;
+  uint32_t cnt;   // これまでに追加したトークン数
+  uint32_t cap;   // 確保済みのトークン数
+  uint32_t mask;  // リングバッファならcap - 1、そうでなければ全ビット1
+  bool ring;
+} TokenBuf;
 
 void error(char *fmt, ...);
 void error_at(char *loc, char *fmt, ...);
-void error_tok(Token *tok, char *fmt, ...);
-Token *peek(char *s);
-Token *consume(char *op);
-Token *consume_ident(void);
-void expect(char *op);
+void error_tok(Token tok, char *fmt, ...);
+extern int error_count;
+extern jmp_buf *error_recovery;
+Token peek_id(TokenKind kind);
+Token consume_id(TokenKind kind);
+Token consume_ident(void);
+void next_token(void);
+void expect_id(TokenKind kind);
 long expect_number(void);
 char *expect_ident(void);
 bool at_eof(void);
-Token *tokenize(void);
+char *intern(char *s, int len);
+void tokenize(void);
 
 extern char *filename;
 extern char *user_input;
-extern Token *token;
+extern TokenBuf tokens;
+extern Token token;
+
+// 種類・長さ・値は、トークン列に残っているトークン
+// (現在のトークンとその直前の数トークン、先読みした分)についてのみ引ける
+static inline uint32_t tok_slot(Token tok) {
+  return (uint32_t)tok & tokens.mask;
+}
+static inline TokenKind tok_kind(Token tok) {
+  return tokens.kind[tok_slot(tok)];
+}
+static inline char *tok_str(Token tok) { return user_input + (tok >> 32); }
+static inline int tok_len(Token tok) { return tokens.len[tok_slot(tok)]; }
+static inline StrLit *tok_strlit(Token tok) {
+  return tokens.val[tok_slot(tok)].str;
+}
+static inline char *tok_ident(Token tok) {
+  return tokens.val[tok_slot(tok)].ident;
+}
+
+// internされた名前のハッシュ値。名前はポインタで区別できるので、
+// ポインタの値をかき混ぜるだけでよい
+static inline uint32_t name_hash(char *name) {
+  return (uint64_t)(uintptr_t)name * 0x9e3779b97f4a7c15 >> 32;
+}
+
+//
+// scan.c
+//
+
+// 空白の並びを読み飛ばし、空白でない最初の文字を返す
+extern char *(*skip_space)(char *p);
+// 行末の改行(または入力の終端)を返す
+extern char *(*skip_line)(char *p);
+// "*/"の位置を返す。見つからなければNULL
+extern char *(*find_comment_end)(char *p);
+// 英数字とアンダーバーの並びを読み飛ばす
+extern char *(*skip_ident)(char *p);
+void init_scan(void);
+
+//
+// arena.c
+//
+
+void *arena_alloc(size_t size);
+void *arena_alloc_local(size_t size);
+void arena_reset(void);
 
 //
 // parse.c
 //
 
+// ノードの番号。0は「ノードなし」を表す
+typedef uint32_t NodeId;
+
 // 変数
 typedef struct Var Var;
 struct Var {
@@ -69,8 +186,17 @@ struct Var {
   int offset;  // RBP(ベースレジスタ)からの相対距離(オフセット)
 
   // Global variable
-  char *contents;
-  int cont_len;
+  char *contents;  // 文字列リテラルの内容。終端の'\0'は含まない
+  int cont_len;    // 終端の'\0'を含む長さ
+
+  // 最適化(opt.c)で使う
+  int nassigns;     // 代入される回数(引数は呼び出し時の1回を含む)
+  int nreads;       // 読み出される回数
+  bool addr_taken;  // アドレスを取られているか(ir.cでも数え直す)
+  NodeId def;       // 代入が1回だけなら、その代入(ND_ASSIGN)
+
+  // 中間表現(ir.c)で使う
+  int vreg;  // 仮想レジスタに置く場合、その番号。0ならメモリ(スタック)に置く
 };
 
 typedef struct VarList VarList;
@@ -109,37 +235,55 @@ typedef enum {
   ND_NULL,       // Empty statement
 } NodeKind;
 
-// 抽象構文木のノードの型
+/*
+  抽象構文木のノードの型
+  ノードは配列に並べて置き、子は番号で指す。ノードの種類によって使うフィールドが
+  決まっているので、同時に使わないものは共用体で重ねて40バイトに収める
+ */
 typedef struct Node Node;
 struct Node {
-  NodeKind kind;  // ノードの型
-  Node *next;     // 次のノード
-  Type *ty;       // Type, e.g. int or pointer to int
-  Token *tok;     // Representative token
-
-  Node *lhs;  // 左辺
-  Node *rhs;  // 右辺
-
-  // "if" or "while" or "for" statement
-  Node *cond;  // condition（条件)
-  Node *then;  // 条件がtrueの場合の処理
-  Node *els;
-  Node *init;  // "for"文の初期値
-  Node *inc;   // final-expression(counterなど)
+  unsigned char kind;  // ノードの型(NodeKind)
+  NodeId next;         // 次のノード
+
+  union {
+    NodeId lhs;   // 左辺
+    NodeId cond;  // "if", "while", "for"の条件
+    NodeId body;  // Block, Statement expression
+    NodeId args;  // Function call
+  };
+  union {
+    NodeId rhs;   // 右辺
+    NodeId then;  // 条件がtrueの場合の処理
+  };
+
+  Token tok;  // Representative token
+  Type *ty;   // Type, e.g. int or pointer to int
+
+  union {
+    NodeId els;  // "if"のelse節
+    struct {
+      NodeId init;  // "for"文の初期値
+      NodeId inc;   // final-expression(counterなど)
+    };
+    Member *member;  // Struct member access
+    char *funcname;  // Function call
+    Var *var;        // ノードの型が変数の場合のみ使う
+    long val;        // kindがND_NUMの場合のみ使う
+  };
+};
 
-  // Block
-  Node *body;
+// ノードはNODE_CHUNK個ずつのかたまりで確保するので、
+// ノードを追加しても既存のノードのアドレスは変わらない
+#define NODE_CHUNK_BITS 12
+#define NODE_CHUNK (1 << NODE_CHUNK_BITS)
 
-  // Struct member access
-  Member *member;
+extern Node **node_chunks;
 
-  // Function call
-  char *funcname;
-  Node *args;
+static inline Node *node_at(NodeId id) {
+  return &node_chunks[id >> NODE_CHUNK_BITS][id & (NODE_CHUNK - 1)];
+}
 
-  Var *var;  // ノードの型が変数の場合のみ使う
-  long val;  // kindがND_NUMの場合のみ使う
-};
+typedef struct BB BB;
 
 typedef struct Function Function;
 struct Function {
@@ -147,9 +291,17 @@ struct Function {
   char *name;
   VarList *params;
 
-  Node *node;
+  NodeId node;
   VarList *locals;
   int stack_size;
+
+  // 中間表現(ir.c)
+  BB *bbs;     // 基本ブロック。出力する順に並ぶ
+  int nvregs;  // 仮想レジスタの数(番号は1から)
+
+  // レジスタ割り当て(regalloc.c)の結果
+  int *loc;       // 仮想レジスタの置き場所。0以上はReg、負ならrbpからの位置
+  int used_regs;  // 使ったcallee-savedのレジスタ(Regのビット)
 };
 
 typedef struct {
@@ -165,7 +317,9 @@ Program *program(void);
 
 typedef enum {
   TY_CHAR,
+  TY_SHORT,
   TY_INT,
+  TY_LONG,
   TY_PTR,
   TY_ARRAY,
   TY_STRUCT,
@@ -174,9 +328,14 @@ typedef enum {
 struct Type {
   TypeKind kind;
   int size;    // sizeof() value
+  int align;   // alignment
   Type *base;  // アドレス先の値
   int array_len;
-  Member *members;  // struct
+
+  // struct
+  Member *members;   // 宣言順のメンバー
+  Member **mem_tab;  // 名前からメンバーを引くハッシュ表
+  int mem_tab_cap;   // mem_tabの大きさ(2の冪)
 };
 
 // Struct member
@@ -188,15 +347,227 @@ struct Member {
 };
 
 extern Type *char_type;
+extern Type *short_type;
 extern Type *int_type;
+extern Type *long_type;
 
 bool is_integer(Type *ty);
 Type *pointer_to(Type *base);
 Type *array_of(Type *base, int len);
-void add_type(Node *node);
+void reset_types(void);
+Type *struct_type(Member *members);
+Member *find_member(Type *ty, char *name);
+void visit_children(Node *node, void (*fn)(NodeId id));
+void add_type(NodeId id);
+
+//
+// opt.c
+//
+
+void optimize(Program *prog);
+
+//
+// ir.c
+//
+
+/*
+  三番地コードの中間表現。d, a, bは仮想レジスタの番号
+  関数は基本ブロックの並びで、各ブロックの最後の命令(IR_JMP, IR_BR, IR_RET)が
+  制御の移る先を決める。最後の命令がそれ以外のブロックは関数の終わりに達する
+  二項演算はbが0なら、右辺に仮想レジスタの代わりに即値immを使う
+  メモリを指す命令(IR_LEA, IR_LOAD, IR_STORE)のアドレスaddrは、
+  x86のアドレス指定と同じく (varのアドレスかa) + index * scale + disp で表す
+ */
+typedef enum {
+  IR_IMM,    // d = imm
+  IR_MOV,    // d = a
+  IR_ADD,    // d = a + b
+  IR_SUB,    // d = a - b
+  IR_MUL,    // d = a * b
+  IR_DIV,    // d = a / b (即値は使えない)
+  IR_EQ,     // d = a == b
+  IR_NE,     // d = a != b
+  IR_LT,     // d = a < b
+  IR_LE,     // d = a <= b
+  IR_LEA,    // d = addr
+  IR_LOAD,   // d = *addr (sizeバイトを読んで符号拡張する)
+  IR_STORE,  // *addr = b (sizeバイトに切り詰めて書き込む)
+  IR_SEXT,   // d = aの下位sizeバイトを符号拡張した値
+  IR_CALL,   // d = funcname(args[0], ..., args[nargs-1])
+  IR_RET,    // return a
+  IR_JMP,    // goto then
+  IR_BR,     // if (a) goto then; else goto els
+} IROp;
+
+// 命令の種類によって使うフィールドが決まっているので、共用体で重ねる
+typedef struct {
+  unsigned char op;     // IROp
+  unsigned char scale;  // アドレスの添字に掛ける数(1, 2, 4, 8)
+  int size;             // IR_LOAD, IR_STORE, IR_SEXT
+  int nargs;            // IR_CALL
+  int d;
+  int a;
+  int b;
+  union {
+    long imm;  // IR_IMM、右辺が即値の二項演算
+    struct {
+      Var *var;   // アドレスの基点の変数(NULLならa)
+      int disp;   // アドレスに足す定数
+      int index;  // アドレスの添字の仮想レジスタ(0ならなし)
+    };
+    struct {
+      char *funcname;  // IR_CALL
+      int *args;
+    };
+    struct {
+      BB *then;  // IR_JMP, IR_BR
+      BB *els;
+    };
+  };
+} IR;
+
+struct BB {
+  BB *next;  // 出力する順で次のブロック
+  int label;
+  IR *ir;
+  int len;
+  int cap;
+  BB *succ[2];  // 制御が移る先のブロック
+  int nsucc;
+
+  // レジスタ割り当て(regalloc.c)で使う
+  int first;           // 最初の命令の位置
+  int last;            // 最後の命令の位置
+  uint64_t *live_in;   // 入口で生きている仮想レジスタ
+  uint64_t *live_out;  // 出口で生きている仮想レジスタ
+};
+
+void gen_ir(Function *fn);
+void print_ir(Function *fn);
+
+//
+// regalloc.c
+//
+
+// 物理レジスタ。関数の引数を渡すレジスタを引数の順に先頭に置く
+// rax, rdxは割り算と戻り値に、r10, r11はコード生成の作業用に取っておく
+// rax, rbp, rspは割り当てには使わないが、命令のオペランドに現れる
+typedef enum {
+  REG_RDI,
+  REG_RSI,
+  REG_RDX,
+  REG_RCX,
+  REG_R8,
+  REG_R9,
+  REG_RBX,
+  REG_R12,
+  REG_R13,
+  REG_R14,
+  REG_R15,
+  REG_R10,
+  REG_R11,
+  REG_RAX,
+  REG_RBP,
+  REG_RSP,
+  REG_NONE,  // アドレスのベース・添字がないことを表す
+} Reg;
+
+void alloc_regs(Function *fn);
 
 //
 // codegen.c
 //
 
 void codegen(Program *prog);
+
+//
+// peephole.c
+//
+
+/*
+  機械語の命令。codegen.cは関数ごとに命令の列を作り、
+  peephole.cで書き換えてからアセンブリとして出力する
+ */
+typedef enum {
+  M_NOP,    // 取り除いた命令(出力しない)
+  M_LABEL,  // .L.bb.label: (labelが0なら関数の終わり)
+  M_MOV,    // mov dst, src
+  M_MOVSX,  // movsx/movsxd dst, src (srcの大きさから符号拡張する)
+  M_MOVZB,  // movzb dst, al
+  M_LEA,    // lea dst, src
+  M_ADD,    // add dst, src
+  M_SUB,    // sub dst, src
+  M_IMUL,   // imul dst, src
+  M_CQO,    // cqo
+  M_IDIV,   // idiv src
+  M_CMP,    // cmp dst, src
+  M_SET,    // setcc al
+  M_JMP,    // jmp label
+  M_JCC,    // jcc label
+  M_CALL,   // call src (引数はnargs個のレジスタで渡す)
+  M_PUSH,   // push src
+  M_POP,    // pop dst
+  M_RET,    // ret
+} MOp;
+
+// M_SET, M_JCCの条件。CC_E ^ 1のように、1ビット目を反転すると逆の条件になる
+typedef enum {
+  CC_E,
+  CC_NE,
+  CC_L,
+  CC_GE,
+  CC_LE,
+  CC_G,
+} CondCode;
+
+typedef enum {
+  OPD_NONE,
+  OPD_REG,  // レジスタ
+  OPD_IMM,  // 即値
+  OPD_MEM,  // [sym+reg+index*scale+val]
+  OPD_SYM,  // シンボル(callの呼び出し先、offsetでアドレスを取るグローバル変数)
+} OperandKind;
+
+typedef struct {
+  unsigned char kind;   // OperandKind
+  unsigned char size;   // OPD_REG, OPD_MEM: 1, 2, 4, 8バイト
+  unsigned char reg;    // OPD_REG: レジスタ。OPD_MEM: ベースのレジスタ
+  unsigned char index;  // OPD_MEM: 添字のレジスタ
+  unsigned char scale;  // OPD_MEM: 添字に掛ける数
+  long val;             // OPD_IMM: 値。OPD_MEM: 変位
+  char *sym;            // OPD_SYM、OPD_MEM: シンボル(なければNULL)
+} Operand;
+
+typedef struct {
+  unsigned char op;     // MOp
+  unsigned char cc;     // M_SET, M_JCC
+  unsigned char nargs;  // M_CALL
+  int label;            // M_LABEL, M_JMP, M_JCC
+  Operand dst;
+  Operand src;
+} Insn;
+
+int peephole(Insn *insns, int len);
+void print_peephole_stats(void);
+
+//
+// emit.c
+//
+
+void emit_open(char *path);
+void emit_close(void);
+void emit_char(int c);
+void emit(char *fmt, ...);
+
+//
+// main.c
+//
+
+extern int lex_threads;
+extern bool stream_lex;
+extern int max_errors;
+extern bool reorder_fields;
+extern bool dump_ir;
+extern bool peephole_stats;
+
+int align_to(int n, int align);
@@ -0,0 +1,115 @@
+#include "./9cc.h"
+
+//
+// 注釈：
+// 構文木・型・変数などを確保するための領域(アリーナ)
+// 確保はポインタを進めるだけで、個別には解放しない。翻訳単位を1つ
+// 出力し終えたらarena_resetでまとめて捨て、次の翻訳単位で同じブロックを使い回す
+//
+
+#define BLOCK_SIZE (1024 * 1024)
+
+typedef struct Block Block;
+struct Block {
+  Block *next;
+  size_t size;  // dataの大きさ
+  char data[];
+};
+
+static Block *blocks;  // 確保済みのブロックのリスト
+static Block *cur;     // 現在使っているブロック
+static char *ptr;      // cur->dataの中の次に確保する位置
+static char *end;      // cur->dataの終わり
+
+// `size`バイト以上の空きのあるブロックに移る
+static void next_block(size_t size) {
+  // リセット前に確保したブロックが残っていれば、それを使い回す
+  Block **p = cur ? &cur->next : &blocks;
+  while (*p && (*p)->size < size) p = &(*p)->next;
+
+  if (!*p) {
+    size_t n = size > BLOCK_SIZE ? size : BLOCK_SIZE;
+    Block *b = malloc(sizeof(Block) + n);
+    if (!b) error("out of memory");
+    b->next = NULL;
+    b->size = n;
+    *p = b;
+  }
+
+  cur = *p;
+  ptr = cur->data;
+  end = cur->data + cur->size;
+}
+
+// 0で埋めた`size`バイトの領域を返す
+void *arena_alloc(size_t size) {
+  size = (size + 15) & ~(size_t)15;
+  if ((size_t)(end - ptr) < size) next_block(size);
+
+  void *p = ptr;
+  ptr += size;
+  return memset(p, 0, size);
+}
+
+//
+// 複数のスレッドから確保する領域
+// 並列字句解析のスレッドは上のアリーナを使えないので、スレッドごとに
+// 使っているブロックを持ち、そこから確保する。ブロックは共有のリストに繋いでおき、
+// arena_resetで上のアリーナと一緒に捨てる
+//
+
+#define LOCAL_BLOCK_SIZE (64 * 1024)
+
+static pthread_mutex_t local_lock = PTHREAD_MUTEX_INITIALIZER;
+static Block *local_used;  // どれかのスレッドが確保に使ったブロック
+static Block *local_free;  // 捨てたブロック。次の確保で使い回す
+static _Thread_local char *local_ptr;
+static _Thread_local char *local_end;
+
+// このスレッドを`size`バイト以上の空きのあるブロックに移す
+static void next_local_block(size_t size) {
+  pthread_mutex_lock(&local_lock);
+  Block **p = &local_free;
+  while (*p && (*p)->size < size) p = &(*p)->next;
+
+  Block *b = *p;
+  if (b) {
+    *p = b->next;
+  } else {
+    size_t n = size > LOCAL_BLOCK_SIZE ? size : LOCAL_BLOCK_SIZE;
+    b = malloc(sizeof(Block) + n);
+    if (!b) error("out of memory");
+    b->size = n;
+  }
+  b->next = local_used;
+  local_used = b;
+  pthread_mutex_unlock(&local_lock);
+
+  local_ptr = b->data;
+  local_end = b->data + b->size;
+}
+
+// 呼び出したスレッドのブロックから、0で埋めた`size`バイトの領域を返す
+void *arena_alloc_local(size_t size) {
+  size = (size + 15) & ~(size_t)15;
+  if ((size_t)(local_end - local_ptr) < size) next_local_block(size);
+
+  void *p = local_ptr;
+  local_ptr += size;
+  return memset(p, 0, size);
+}
+
+// これまでに確保したすべての領域を捨てる。ブロックは次の確保で使い回す
+// arena_alloc_localを使うスレッドは、すべて終わっていなければならない
+void arena_reset(void) {
+  cur = NULL;
+  ptr = end = NULL;
+
+  while (local_used) {
+    Block *b = local_used;
+    local_used = b->next;
+    b->next = local_free;
+    local_free = b;
+  }
+  local_ptr = local_end = NULL;
+}
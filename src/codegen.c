@@ -1,326 +1,573 @@
 #include "./9cc.h"
 
 //
-// 条件分岐によってアセンブリ言語を標準出力する
+// 中間表現からアセンブリ言語を出力する(出力はemit.cを通す)
+// 仮想レジスタの置き場所はregalloc.cで決まっている。スタックに置いたものは
+// 作業用のr10, r11に読み込んでから使う
+// 関数ごとに命令の列(Insn)を作り、peephole.cで書き換えてから出力する
 //
 
-// 1byte用 第一引数、第二引数、第三引数…と順に続く配列
-static char *argreg1[] = {"dil", "sil", "dl", "cl", "r8b", "r9b"};
-// 8byte用 第一引数、第二引数、第三引数…と順に続く配列
-static char *argreg8[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+// Regの順に並べたレジスタの名前。1, 2, 4, 8バイト用
+static char *reg1[] = {"dil", "sil",  "dl",   "cl",   "r8b",  "r9b",
+                       "bl",  "r12b", "r13b", "r14b", "r15b", "r10b",
+                       "r11b", "al",  "bpl",  "spl"};
+static char *reg2[] = {"di",  "si",   "dx",   "cx",   "r8w",  "r9w",
+                       "bx",  "r12w", "r13w", "r14w", "r15w", "r10w",
+                       "r11w", "ax",  "bp",   "sp"};
+static char *reg4[] = {"edi", "esi",  "edx",  "ecx",  "r8d",  "r9d",
+                       "ebx", "r12d", "r13d", "r14d", "r15d", "r10d",
+                       "r11d", "eax", "ebp",  "esp"};
+static char *reg8[] = {"rdi", "rsi", "rdx", "rcx", "r8",  "r9",
+                       "rbx", "r12", "r13", "r14", "r15", "r10",
+                       "r11", "rax", "rbp", "rsp"};
+
+static Function *fn;  // 出力している関数
+
+static Insn *insns;  // 出力している関数の命令
+static int ninsns;
+static int insns_cap;
+
+static Insn *add_insn(MOp op, Operand dst, Operand src) {
+  if (ninsns == insns_cap) {
+    insns_cap = insns_cap ? insns_cap * 2 : 256;
+    insns = realloc(insns, insns_cap * sizeof(Insn));
+  }
+  Insn *insn = &insns[ninsns++];
+  *insn = (Insn){.op = op, .dst = dst, .src = src};
+  return insn;
+}
+
+#define NONE ((Operand){OPD_NONE})
+
+static Operand sized_reg(int reg, int size) {
+  return (Operand){.kind = OPD_REG, .size = size, .reg = reg};
+}
+
+static Operand reg(int reg) { return sized_reg(reg, 8); }
+
+static Operand imm(long val) { return (Operand){.kind = OPD_IMM, .val = val}; }
+
+// [base+disp]のsizeバイト
+static Operand mem(int base, long disp, int size) {
+  return (Operand){.kind = OPD_MEM,
+                   .size = size,
+                   .reg = base,
+                   .index = REG_NONE,
+                   .val = disp};
+}
+
+static Operand sym(char *name) {
+  return (Operand){.kind = OPD_SYM, .sym = name};
+}
+
+static void mov(Operand dst, Operand src) { add_insn(M_MOV, dst, src); }
+
+static void label(int label) { add_insn(M_LABEL, NONE, NONE)->label = label; }
+
+static void jump(MOp op, CondCode cc, int label) {
+  Insn *insn = add_insn(op, NONE, NONE);
+  insn->cc = cc;
+  insn->label = label;
+}
+
+// 仮想レジスタ`r`の値のあるレジスタを返す。スタックにあれば`tmp`に読み込む
+static int use(int r, Reg tmp) {
+  int loc = fn->loc[r];
+  if (loc >= 0) return loc;
+  mov(reg(tmp), mem(REG_RBP, loc, 8));
+  return tmp;
+}
+
+// 仮想レジスタ`r`に書き込む値を計算するレジスタ。スタックに置くなら`tmp`
+static int def(int r, Reg tmp) {
+  int loc = fn->loc[r];
+  return loc >= 0 ? loc : tmp;
+}
+
+// defで返したレジスタ`r_reg`の値を、スタックに置く仮想レジスタ`r`に書き込む
+static void spill(int r, int r_reg) {
+  int loc = fn->loc[r];
+  if (loc < 0) mov(mem(REG_RBP, loc, 8), reg(r_reg));
+}
 
-// ユニークなアセンブラのラベルを生成するための変数
-static int labelseq = 1;
-static char *funcname;
+// 命令`ir`のアドレスを、sizeバイトのメモリのオペランドにする
+// ベースと添字がスタックにあれば、r10, r11に読み込む
+static Operand addr(IR *ir, int size) {
+  Operand opd = mem(REG_NONE, ir->disp, size);
+  if (!ir->var) {
+    opd.reg = use(ir->a, REG_R10);
+  } else if (ir->var->is_local) {
+    opd.reg = REG_RBP;
+    opd.val -= ir->var->offset;
+  } else {
+    opd.sym = ir->var->name;
+  }
 
-static void gen(Node *node);
+  if (ir->index) {
+    opd.index = use(ir->index, REG_R11);
+    opd.scale = ir->scale;
+  }
+  return opd;
+}
 
-/* 与えられたノードの変数のオフセット分だけメモリを確保し、そのアドレスをスタックに積む関数
+/*
+  レジスタへの移動dst[i] <- src[i]をまとめて行う(srcが負ならrbpからの位置)
+  まだ読んでいない移動元を上書きしないよう、移動先が他の移動元になっていない
+  ものから行う。入れ替えのように循環している場合は、r11に逃がして解く
  */
-static void gen_addr(Node *node) {
-  switch (node->kind) {
-    case ND_VAR: {
-      Var *var = node->var;
-      if (var->is_local) {
-        // アドレス計算 lea命令
-        printf("  lea rax, [rbp-%d]\n", var->offset);
-        printf("  push rax\n");
-      } else {
-        printf("  push offset %s\n", var->name);
+static void parallel_move(int *dst, int *src, int n) {
+  bool *done = calloc(n, sizeof(bool));
+  for (int i = 0; i < n; i++) done[i] = dst[i] == src[i];
+
+  for (;;) {
+    bool left = false;
+    bool progress = false;
+    for (int i = 0; i < n; i++) {
+      if (done[i]) continue;
+
+      bool blocked = false;
+      for (int j = 0; j < n; j++)
+        if (!done[j] && j != i && src[j] == dst[i]) blocked = true;
+      if (blocked) {
+        left = true;
+        continue;
       }
-      return;
+
+      if (src[i] >= 0)
+        mov(reg(dst[i]), reg(src[i]));
+      else
+        mov(reg(dst[i]), mem(REG_RBP, src[i], 8));
+      done[i] = true;
+      progress = true;
     }
-    case ND_DEREF:
-      gen(node->lhs);
-      return;
-    case ND_MEMBER:
-      gen_addr(node->lhs);
-      printf("  pop rax\n");
-      printf("  add rax, %d\n", node->member->offset);
-      printf("  push rax\n");
-      return;
+    if (!left) break;
+    if (progress) continue;
+
+    // 循環している。1つの移動先の値をr11に逃がす
+    int i = 0;
+    while (done[i]) i++;
+    mov(reg(REG_R11), reg(dst[i]));
+    for (int j = 0; j < n; j++)
+      if (!done[j] && src[j] == dst[i]) src[j] = REG_R11;
   }
+  free(done);
+}
 
-  error_tok(node->tok, "not an lvalue");
+// d = a op immの形の演算
+static void gen_arith_imm(IR *ir, MOp op) {
+  int a = use(ir->a, REG_R10);
+  int d = def(ir->d, REG_R10);
+  long disp = op == M_SUB ? -ir->imm : ir->imm;
+
+  if (d != a && op != M_IMUL && disp == (int)disp) {
+    // 加減算はleaを使えば、aを写さずに1命令で済む
+    add_insn(M_LEA, reg(d), mem(a, disp, 8));
+  } else {
+    if (d != a) mov(reg(d), reg(a));
+    add_insn(op, reg(d), imm(ir->imm));
+  }
+  spill(ir->d, d);
 }
 
-static void gen_lval(Node *node) {
-  if (node->ty->kind == TY_ARRAY) error_tok(node->tok, "not an lvalue");
-  gen_addr(node);
+// d = a op bの形の演算。x86の命令は2オペランドなので、dにaを写してから演算する
+static void gen_arith(IR *ir, MOp op, bool commutative) {
+  if (!ir->b) {
+    gen_arith_imm(ir, op);
+    return;
+  }
+
+  int a = use(ir->a, REG_R10);
+  int b = use(ir->b, REG_R11);
+  int d = def(ir->d, REG_R10);
+
+  if (d == b && d != a) {
+    // aを写すとbが壊れる
+    if (commutative) {
+      add_insn(op, reg(d), reg(a));
+    } else {
+      mov(reg(REG_RAX), reg(a));
+      add_insn(op, reg(REG_RAX), reg(b));
+      mov(reg(d), reg(REG_RAX));
+    }
+  } else {
+    if (d != a) mov(reg(d), reg(a));
+    add_insn(op, reg(d), reg(b));
+  }
+  spill(ir->d, d);
 }
 
-static void load(Type *ty) {
-  printf("  pop rax\n");
-  if (ty->size == 1)
-    printf("  movsx rax, byte ptr [rax]\n");
-  else
-    printf("  mov rax, [rax]\n");
-  printf("  push rax\n");
+static void gen_cmp(IR *ir, CondCode cc) {
+  int a = use(ir->a, REG_R10);
+  Operand b = ir->b ? reg(use(ir->b, REG_R11)) : imm(ir->imm);
+  int d = def(ir->d, REG_R10);
+  add_insn(M_CMP, reg(a), b);
+  add_insn(M_SET, NONE, NONE)->cc = cc;
+  add_insn(M_MOVZB, reg(d), sized_reg(REG_RAX, 1));
+  spill(ir->d, d);
 }
 
-static void store(Type *ty) {
-  printf("  pop rdi\n");
-  printf("  pop rax\n");
+// 関数呼び出し。RSPは常に16の倍数になっている
+static void gen_call(IR *ir) {
+  int dst[6];
+  int src[6];
+  for (int i = 0; i < ir->nargs; i++) {
+    dst[i] = i;  // 引数のレジスタはRegの先頭に並んでいる
+    src[i] = fn->loc[ir->args[i]];
+  }
+  parallel_move(dst, src, ir->nargs);
 
-  if (ty->size == 1)
-    printf("  mov [rax], dil\n");
-  else
-    printf("  mov [rax], rdi\n");
+  // 可変長引数の関数のために、RAXにベクトルレジスタの引数の数(0)を入れる
+  mov(reg(REG_RAX), imm(0));
+  add_insn(M_CALL, NONE, sym(ir->funcname))->nargs = ir->nargs;
 
-  printf("  push rdi\n");
+  int loc = fn->loc[ir->d];
+  if (loc >= 0)
+    mov(reg(loc), reg(REG_RAX));
+  else if (loc != -1)
+    mov(mem(REG_RBP, loc, 8), reg(REG_RAX));
 }
 
-/* スタックマシンライクな構文木からのアセンブリ出力関数 */
-void gen(Node *node) {
-  switch (node->kind) {
-    case ND_NULL:
+// 1つの命令を出力する
+static void gen_ir_insn(IR *ir) {
+  switch (ir->op) {
+    case IR_IMM: {
+      int d = def(ir->d, REG_R10);
+      mov(reg(d), imm(ir->imm));
+      spill(ir->d, d);
       return;
-    case ND_NUM:
-      printf("  push %ld\n", node->val);
+    }
+    case IR_MOV: {
+      int a = use(ir->a, REG_R10);
+      int d = def(ir->d, REG_R10);
+      if (d != a) mov(reg(d), reg(a));
+      spill(ir->d, d);
       return;
-    case ND_EXPR_STMT:
-      gen(node->lhs);
-      printf("  add rsp, 8\n");
+    }
+    case IR_ADD:
+      gen_arith(ir, M_ADD, true);
       return;
-    case ND_VAR:
-    case ND_MEMBER:
-      gen_addr(node);
-      if (node->ty->kind != TY_ARRAY) load(node->ty);
+    case IR_SUB:
+      gen_arith(ir, M_SUB, false);
       return;
-    case ND_ASSIGN:
-      gen_lval(node->lhs);
-      gen(node->rhs);
-      store(node->ty);
+    case IR_MUL:
+      gen_arith(ir, M_IMUL, true);
       return;
-    case ND_ADDR:
-      gen_addr(node->lhs);
+    case IR_DIV: {
+      // idivはrdx:raxを割るので、rax, rdxは割り当てに使っていない
+      int a = use(ir->a, REG_R10);
+      int b = use(ir->b, REG_R11);
+      int d = def(ir->d, REG_R10);
+      mov(reg(REG_RAX), reg(a));
+      add_insn(M_CQO, NONE, NONE);
+      add_insn(M_IDIV, NONE, reg(b));
+      mov(reg(d), reg(REG_RAX));
+      spill(ir->d, d);
       return;
-    case ND_DEREF:
-      gen(node->lhs);
-      if (node->ty->kind != TY_ARRAY) load(node->ty);
+    }
+    case IR_EQ:
+      gen_cmp(ir, CC_E);
       return;
-    case ND_IF: {
-      int seq = labelseq++;
-      if (node->els) {
-        gen(node->cond);
-        printf("  pop rax\n");
-        printf("  cmp rax, 0\n");
-        printf("  je  .L.else.%d\n", seq);
-        gen(node->then);
-        printf("  jmp .L.end.%d\n", seq);
-        printf(".L.else.%d:\n", seq);
-        gen(node->els);
-        printf(".L.end.%d:\n", seq);
-      } else {
-        gen(node->cond);
-        printf("  pop rax\n");
-        printf(
-            "  cmp rax, 0\n");  // if条件がfalse(0)の場合、if文から外れる(goto
-                                // end)
-        printf("  je  .L.end.%d\n", seq);
-        gen(node->then);
-        printf(".L.end.%d:\n", seq);
-      }
+    case IR_NE:
+      gen_cmp(ir, CC_NE);
       return;
-    }
-    case ND_WHILE: {
-      int seq = labelseq++;
-      printf(".L.begin.%d:\n", seq);
-      gen(node->cond);
-      printf("  pop rax\n");
-      printf("  cmp rax, 0\n");
-      printf("  je  .L.end.%d\n", seq);
-      gen(node->then);
-      printf("  jmp .L.begin.%d\n", seq);
-      printf(".L.end.%d:\n", seq);
+    case IR_LT:
+      gen_cmp(ir, CC_L);
+      return;
+    case IR_LE:
+      gen_cmp(ir, CC_LE);
+      return;
+    case IR_LEA: {
+      Operand src = addr(ir, 8);
+      int d = def(ir->d, REG_R10);
+      add_insn(M_LEA, reg(d), src);
+      spill(ir->d, d);
       return;
     }
-    case ND_FOR: {
-      int seq = labelseq++;
-      if (node->init) gen(node->init);
-      printf(".L.begin.%d:\n", seq);
-      if (node->cond) {
-        gen(node->cond);
-        printf("  pop rax\n");
-        printf("  cmp rax, 0\n");
-        printf("  je  .L.end.%d\n", seq);
-      }
-      gen(node->then);
-      if (node->inc) gen(node->inc);
-      printf("  jmp .L.begin.%d\n", seq);
-      printf(".L.end.%d:\n", seq);
+    case IR_LOAD: {
+      // 1, 2, 4バイトは読んだ値を64ビットに符号拡張する
+      // 構造体は中間表現で8バイト以下に分けてあるので、ここには来ない
+      assert(ir->size == 1 || ir->size == 2 || ir->size == 4 || ir->size == 8);
+      Operand src = addr(ir, ir->size);
+      int d = def(ir->d, REG_R10);
+      add_insn(ir->size == 8 ? M_MOV : M_MOVSX, reg(d), src);
+      spill(ir->d, d);
       return;
     }
-    case ND_BLOCK:
-    case ND_STMT_EXPR:
-      for (Node *n = node->body; n; n = n->next) gen(n);
+    case IR_STORE: {
+      // r10, r11はアドレスに使うので、値はraxに読み込む
+      Operand dst = addr(ir, ir->size);
+      int b = use(ir->b, REG_RAX);
+      mov(dst, sized_reg(b, ir->size));
       return;
-    case ND_FUNCALL: {
-      int nargs = 0;
-      for (Node *arg = node->args; arg; arg = arg->next) {
-        gen(arg);
-        nargs++;
-      };
-
-      // 配列のindexは0から始まるので-1する
-      for (int i = nargs - 1; i >= 0; i--) {
-        printf("  pop %s\n", argreg8[i]);
-      }
-
-      // 関数を呼び出す前に RSP を 16 バイト境界に揃える必要があります。これは
-      // ABI の要求です。 可変長の関数では RAX を 0 に設定します。
-
-      // アセンブララベル名のインデックス
-      int seq = labelseq++;
-      printf("  mov rax, rsp\n");
-      // 15の2進数は`1111`。これを論理積しても値は変化しない。
-      printf("  and rax, 15\n");  //
-
-      // ? jnzがcmp命令なしで動作する理由が不明
-      printf("  jnz .L.call.%d\n", seq);  // 16バイトの場合
-      printf("  mov rax, 0\n");
-      printf("  call %s\n", node->funcname);
-      printf("  jmp .L.end.%d\n", seq);
-
-      printf(".L.call.%d:\n", seq);  // 8バイトの場合、
-      printf("  sub rsp, 8\n");      // 8を引いて16の倍数にしてから
-      printf("  mov rax, 0\n");
-      printf("  call %s\n", node->funcname);  // 関数呼び出し。
-      printf("  add rsp, 8\n");
-      printf(".L.end.%d:\n", seq);
-      printf("  push rax\n");
+    }
+    case IR_SEXT: {
+      int a = use(ir->a, REG_R10);
+      int d = def(ir->d, REG_R10);
+      if (ir->size < 8)
+        add_insn(M_MOVSX, reg(d), sized_reg(a, ir->size));
+      else if (d != a)
+        mov(reg(d), reg(a));
+      spill(ir->d, d);
       return;
     }
-    case ND_RETURN:
-      gen(node->lhs);
-      printf("  pop rax\n");
+    case IR_CALL:
+      gen_call(ir);
+      return;
+    case IR_RET:
+      mov(reg(REG_RAX), reg(use(ir->a, REG_R10)));
       // JMP命令: 無条件に指定した場所に移動する
-      printf("  jmp .L.return.%s\n", funcname);
+      jump(M_JMP, 0, 0);
+      return;
+    case IR_JMP:
+      jump(M_JMP, 0, ir->then->label);
+      return;
+    case IR_BR:
+      add_insn(M_CMP, reg(use(ir->a, REG_R10)), imm(0));
+      jump(M_JCC, CC_E, ir->els->label);
+      jump(M_JMP, 0, ir->then->label);
       return;
   }
+}
 
-  gen(node->lhs);
-  gen(node->rhs);
+static char *cc_name[] = {
+    [CC_E] = "e",   [CC_NE] = "ne", [CC_L] = "l",
+    [CC_GE] = "ge", [CC_LE] = "le", [CC_G] = "g",
+};
 
-  printf("  pop rdi\n");
-  printf("  pop rax\n");
+static void print_label(int label) {
+  // 0は関数の終わり
+  if (label)
+    emit(".L.bb.%d", label);
+  else
+    emit(".L.return.%s", fn->name);
+}
 
-  switch (node->kind) {
-    case ND_ADD:
-      printf("  add rax, rdi\n");
-      break;
-    case ND_PTR_ADD:
-      printf("  imul rdi, %d\n", node->ty->base->size);
-      printf("  add rax, rdi\n");
-      break;
-    case ND_SUB:
-      printf("  sub rax, rdi\n");
-      break;
-    case ND_PTR_SUB:
-      printf("  imul rdi, %d\n", node->ty->base->size);
-      printf("  sub rax, rdi\n");
-      break;
-    case ND_PTR_DIFF:
-      printf("  sub rax, rdi\n");
-      printf("  cqo\n");
-      printf("  mov rdi, %d\n", node->lhs->ty->base->size);
-      printf("  idiv rdi\n");
-      break;
-    case ND_MUL:
-      printf("  imul rax, rdi\n");
-      break;
-    case ND_DIV:
-      printf("  cqo\n");
-      printf("  idiv rdi\n");
-      break;
-    case ND_EQ:
-      printf("  cmp rax, rdi\n");
-      printf("  sete al\n");
-      printf("  movzb rax, al\n");
-      break;
-    case ND_NE:
-      printf("  cmp rax, rdi\n");
-      printf("  setne al\n");
-      printf("  movzb rax, al\n");
-      break;
-    case ND_LT:
-      printf("  cmp rax, rdi\n");
-      printf("  setl al\n");
-      printf("  movzb rax, al\n");
-      break;
-    case ND_LE:
-      printf("  cmp rax, rdi\n");
-      printf("  setle al\n");
-      printf("  movzb rax, al\n");
+// アドレス[sym+reg+index*scale+val]を書く
+static void print_addr(Operand *opd) {
+  emit("[");
+  char *sep = "";
+  if (opd->sym) {
+    emit("%s", opd->sym);
+    sep = "+";
+  }
+  if (opd->reg != REG_NONE) {
+    emit("%s%s", sep, reg8[opd->reg]);
+    sep = "+";
+  }
+  if (opd->index != REG_NONE)
+    emit("%s%s*%d", sep, reg8[opd->index], opd->scale);
+  if (opd->val > 0) emit("+");
+  if (opd->val) emit("%ld", opd->val);
+  emit("]");
+}
+
+static void print_operand(Operand *opd) {
+  switch (opd->kind) {
+    case OPD_REG:
+      if (opd->size == 1)
+        emit("%s", reg1[opd->reg]);
+      else if (opd->size == 2)
+        emit("%s", reg2[opd->reg]);
+      else if (opd->size == 4)
+        emit("%s", reg4[opd->reg]);
+      else
+        emit("%s", reg8[opd->reg]);
+      return;
+    case OPD_IMM:
+      emit("%ld", opd->val);
+      return;
+    case OPD_MEM:
+      if (opd->size == 1)
+        emit("byte ptr ");
+      else if (opd->size == 2)
+        emit("word ptr ");
+      else if (opd->size == 4)
+        emit("dword ptr ");
+      else
+        emit("qword ptr ");
+      print_addr(opd);
+      return;
+    case OPD_SYM:
+      emit("offset %s", opd->sym);
+      return;
+  }
+}
+
+static char *insn_name[] = {
+    [M_MOV] = "mov",   [M_MOVZB] = "movzb", [M_LEA] = "lea",
+    [M_ADD] = "add",   [M_SUB] = "sub",     [M_IMUL] = "imul",
+    [M_CQO] = "cqo",   [M_IDIV] = "idiv",   [M_CMP] = "cmp",
+    [M_PUSH] = "push", [M_POP] = "pop",     [M_RET] = "ret",
+};
+
+static void print_insn(Insn *insn) {
+  switch (insn->op) {
+    case M_NOP:
+      return;
+    case M_LABEL:
+      print_label(insn->label);
+      emit(":\n");
+      return;
+    case M_JMP:
+      emit("  jmp ");
+      print_label(insn->label);
+      emit("\n");
+      return;
+    case M_JCC:
+      emit("  j%s ", cc_name[insn->cc]);
+      print_label(insn->label);
+      emit("\n");
+      return;
+    case M_SET:
+      emit("  set%s al\n", cc_name[insn->cc]);
+      return;
+    case M_CALL:
+      emit("  call %s\n", insn->src.sym);
+      return;
+    case M_LEA:
+      // アドレスを求めるだけなので、大きさは書かない
+      emit("  lea %s, ", reg8[insn->dst.reg]);
+      print_addr(&insn->src);
+      emit("\n");
+      return;
+    case M_MOVSX:
+      emit(insn->src.size == 4 ? "  movsxd" : "  movsx");
       break;
+    default:
+      emit("  %s", insn_name[insn->op]);
   }
 
-  printf("  push rax\n");
+  if (insn->dst.kind != OPD_NONE) {
+    emit(" ");
+    print_operand(&insn->dst);
+    if (insn->src.kind != OPD_NONE) emit(",");
+  }
+  if (insn->src.kind != OPD_NONE) {
+    emit(" ");
+    print_operand(&insn->src);
+  }
+  emit("\n");
+}
+
+/*
+  `len`バイトの文字列と終端の'\0'を、1行あたり最大64バイトの
+  .ascii/.string疑似命令として出力する
+ */
+static void emit_string(char *s, int len) {
+  int i = 0;
+  do {
+    int end = len - i > 64 ? i + 64 : len;
+    emit("  %s \"", end == len ? ".string" : ".ascii");
+
+    for (; i < end; i++) {
+      unsigned char c = s[i];
+      if (c == '"' || c == '\\')
+        emit("\\%c", c);
+      else if (isprint(c))
+        emit_char(c);
+      else
+        emit("\\%c%c%c", '0' + (c >> 6), '0' + (c >> 3 & 7), '0' + (c & 7));
+    }
+    emit("\"\n");
+  } while (i < len);
 }
 
 static void emit_data(Program *prog) {
-  printf(".data\n");
+  emit(".data\n");
 
   for (VarList *vl = prog->globals; vl; vl = vl->next) {
     Var *var = vl->var;
-    printf("%s:\n", var->name);
+    emit("  .align %d\n", var->ty->align);
+    emit("%s:\n", var->name);
 
     if (!var->contents) {
-      printf("  .zero %d\n", var->ty->size);
+      emit("  .zero %d\n", var->ty->size);
       continue;
     }
 
-    for (int i = 0; i < var->cont_len; i++)
-      printf("  .byte %d\n", var->contents[i]);
+    emit_string(var->contents, var->cont_len - 1);
   }
 }
 
-/* ty->sizeから`1byte`か`8byte`かを判別し、rbpへ`idx`番目のレジスタをコピーする
+
+/*
+  引数を受け取る。メモリに置く引数は型の大きさで書き込み、
+  仮想レジスタに置く引数は符号拡張してから、割り当てたレジスタに移す
  */
-static void load_arg(Var *var, int idx) {
-  int sz = var->ty->size;
-  if (sz == 1) {
-    printf("  mov [rbp-%d], %s\n", var->offset, argreg1[idx]);
-  } else {
-    assert(sz == 8);
-    printf("  mov [rbp-%d], %s\n", var->offset, argreg8[idx]);
+static void load_params(void) {
+  int dst[6];
+  int src[6];
+  int n = 0;
+
+  int idx = 0;
+  for (VarList *vl = fn->params; vl; vl = vl->next, idx++) {
+    Var *var = vl->var;
+    int sz = var->ty->size;
+    if (!var->vreg) {
+      mov(mem(REG_RBP, -var->offset, sz), sized_reg(idx, sz));
+      continue;
+    }
+
+    int loc = fn->loc[var->vreg];
+    if (loc == -1) continue;  // 使われていない
+
+    if (sz < 8) add_insn(M_MOVSX, reg(idx), sized_reg(idx, sz));
+
+    if (loc < 0) {
+      mov(mem(REG_RBP, loc, 8), reg(idx));
+      continue;
+    }
+    dst[n] = loc;
+    src[n] = idx;
+    n++;
   }
+  parallel_move(dst, src, n);
 }
 
 static void emit_text(Program *prog) {
-  printf(".text\n");
+  emit(".text\n");
 
-  for (Function *fn = prog->fns; fn; fn = fn->next) {
-    printf(".global %s\n", fn->name);
-    printf("%s:\n", fn->name);
-    funcname = fn->name;
+  for (fn = prog->fns; fn; fn = fn->next) {
+    emit(".global %s\n", fn->name);
+    emit("%s:\n", fn->name);
+    ninsns = 0;
 
     // Prologue
-    printf("  push rbp\n");
-    printf("  mov rbp, rsp\n");
-    printf("  sub rsp, %d\n", fn->stack_size);
+    add_insn(M_PUSH, NONE, reg(REG_RBP));
+    mov(reg(REG_RBP), reg(REG_RSP));
+    add_insn(M_SUB, reg(REG_RSP), imm(fn->stack_size));
 
-    // Push arguments to the stack
-    int i = 0;
-    for (VarList *vl = fn->params; vl; vl = vl->next) {
-      load_arg(vl->var, i++);
-    }
+    // 使うcallee-savedのレジスタを、フレームの先頭に退避する
+    int offset = 0;
+    for (int r = REG_RBX; r <= REG_R15; r++)
+      if (fn->used_regs & (1 << r))
+        mov(mem(REG_RBP, -(offset += 8), 8), reg(r));
+
+    load_params();
 
     // Emit code
-    for (Node *node = fn->node; node; node = node->next) {
-      gen(node);
+    for (BB *bb = fn->bbs; bb; bb = bb->next) {
+      label(bb->label);
+      for (int i = 0; i < bb->len; i++) gen_ir_insn(&bb->ir[i]);
     }
 
     // Epilogue
-    printf(".L.return.%s:\n", funcname);
-    printf("  mov rsp, rbp\n");
-    printf("  pop rbp\n");
-    printf("  ret\n");
+    label(0);
+    offset = 0;
+    for (int r = REG_RBX; r <= REG_R15; r++)
+      if (fn->used_regs & (1 << r))
+        mov(reg(r), mem(REG_RBP, -(offset += 8), 8));
+    mov(reg(REG_RSP), reg(REG_RBP));
+    add_insn(M_POP, reg(REG_RBP), NONE);
+    add_insn(M_RET, NONE, NONE);
+
+    ninsns = peephole(insns, ninsns);
+    for (int i = 0; i < ninsns; i++) print_insn(&insns[i]);
   }
 }
 
 void codegen(Program *prog) {
-  printf(".intel_syntax noprefix\n");
+  emit(".intel_syntax noprefix\n");
   emit_data(prog);
   emit_text(prog);
 }
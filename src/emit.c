@@ -0,0 +1,106 @@
+#include "./9cc.h"
+
+//
+// 注釈：
+// アセンブリの出力。printfは呼び出しごとに書式を解釈し、FILEのロックも取るので、
+// 命令の数だけ呼ぶと時間がかかる。ここでは大きなバッファに自前で文字を並べ、
+// いっぱいになるか出力を閉じるときにだけwriteでまとめて書き出す
+//
+
+#define BUF_SIZE (1024 * 1024)
+
+static char buf[BUF_SIZE];
+static size_t buf_len;
+static int out_fd = STDOUT_FILENO;
+static char *out_path = "stdout";
+
+// バッファの内容をすべて書き出す
+static void flush(void) {
+  char *p = buf;
+  while (buf_len) {
+    ssize_t n = write(out_fd, p, buf_len);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      error("cannot write %s: %s", out_path, strerror(errno));
+    }
+    p += n;
+    buf_len -= n;
+  }
+}
+
+// 出力先を`path`にする。NULLなら標準出力
+void emit_open(char *path) {
+  if (!path) return;
+  out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out_fd == -1) error("cannot open %s: %s", path, strerror(errno));
+  out_path = path;
+}
+
+// 残りを書き出して出力を閉じる
+void emit_close(void) {
+  flush();
+  if (out_fd != STDOUT_FILENO && close(out_fd))
+    error("cannot close %s: %s", out_path, strerror(errno));
+}
+
+void emit_char(int c) {
+  if (buf_len == BUF_SIZE) flush();
+  buf[buf_len++] = c;
+}
+
+static void emit_str(char *s) {
+  for (; *s; s++) emit_char(*s);
+}
+
+// 10進数で出力する。LONG_MINでもあふれないよう符号なしで計算する
+static void emit_long(long val) {
+  unsigned long u = val;
+  if (val < 0) {
+    emit_char('-');
+    u = -u;
+  }
+
+  char digits[20];
+  int n = 0;
+  do {
+    digits[n++] = '0' + u % 10;
+    u /= 10;
+  } while (u);
+  while (n) emit_char(digits[--n]);
+}
+
+/*
+  printfの代わり。使える書式は%s, %c, %d, %ldのみ
+  幅や精度の指定はないので、書式は1文字ずつ見ていくだけで済む
+ */
+void emit(char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+
+  for (char *p = fmt; *p; p++) {
+    if (*p != '%') {
+      emit_char(*p);
+      continue;
+    }
+
+    switch (*++p) {
+      case 's':
+        emit_str(va_arg(ap, char *));
+        break;
+      case 'c':
+        emit_char(va_arg(ap, int));
+        break;
+      case 'd':
+        emit_long(va_arg(ap, int));
+        break;
+      case 'l':
+        assert(p[1] == 'd');
+        p++;
+        emit_long(va_arg(ap, long));
+        break;
+      default:
+        error("emit: unsupported format: %s", fmt);
+    }
+  }
+  va_end(ap);
+}
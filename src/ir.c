@@ -0,0 +1,793 @@
+#include "./9cc.h"
+
+//
+// 注釈：
+// 構文木を中間表現(三番地コード)に変換する
+// 式の値はいくらでも使える仮想レジスタに置き、どれを物理レジスタに置くかは
+// regalloc.cで決める。アドレスを取られないスカラーのローカル変数も、
+// メモリではなく仮想レジスタに置く
+// 制御文は基本ブロックに分け、ブロックの最後の命令で次のブロックを指す
+// 命令選択もここで行う。定数の右辺は即値にし、メモリを指す部分木は
+// x86のアドレス指定の形に当てはめて、1つの命令で読み書きできるようにする
+// 構文木は仕事(Work)のスタックに積んで辿る
+//
+
+static Function *fn;  // 変換している関数
+static BB *cur;       // 命令を追加しているブロック
+static BB *last_bb;   // fn->bbsの最後のブロック
+
+// 作ったブロック。仕事(Work)からは番号で指す
+static BB **blocks;
+static int nblocks;
+static int blocks_cap;
+
+// ブロックのラベルの番号。翻訳単位をまたいで重ならないよう、リセットしない
+static int label_seq = 1;
+
+static BB *new_bb(void) {
+  BB *bb = arena_alloc(sizeof(BB));
+  bb->label = label_seq++;
+
+  if (nblocks == blocks_cap) {
+    blocks_cap = blocks_cap ? blocks_cap * 2 : 64;
+    blocks = realloc(blocks, blocks_cap * sizeof(BB *));
+  }
+  blocks[nblocks++] = bb;
+  return bb;
+}
+
+// これから`bb`に命令を追加する。ブロックはこの順に出力する
+static void start_bb(BB *bb) {
+  if (last_bb)
+    last_bb->next = bb;
+  else
+    fn->bbs = bb;
+  last_bb = bb;
+  cur = bb;
+}
+
+static IR *new_ir(IROp op) {
+  if (cur->len == cur->cap) {
+    // アリーナは伸ばせないので、新しい領域に移す
+    int cap = cur->cap ? cur->cap * 2 : 16;
+    IR *ir = arena_alloc(cap * sizeof(IR));
+    if (cur->len) memcpy(ir, cur->ir, cur->len * sizeof(IR));
+    cur->ir = ir;
+    cur->cap = cap;
+  }
+  IR *ir = &cur->ir[cur->len++];
+  ir->op = op;
+  return ir;
+}
+
+static int new_reg(void) { return ++fn->nvregs; }
+
+// 新しい仮想レジスタにa op bの結果を置く命令を追加し、その番号を返す
+static int new_op(IROp op, int a, int b) {
+  IR *ir = new_ir(op);
+  ir->d = new_reg();
+  ir->a = a;
+  ir->b = b;
+  return ir->d;
+}
+
+// 右辺が即値の二項演算
+static int new_op_imm(IROp op, int a, long imm) {
+  IR *ir = new_ir(op);
+  ir->d = new_reg();
+  ir->a = a;
+  ir->b = 0;
+  ir->imm = imm;
+  return ir->d;
+}
+
+static int new_imm(long val) {
+  IR *ir = new_ir(IR_IMM);
+  ir->d = new_reg();
+  ir->imm = val;
+  return ir->d;
+}
+
+static void jmp(BB *bb) {
+  IR *ir = new_ir(IR_JMP);
+  ir->then = bb;
+  cur->succ[0] = bb;
+  cur->nsucc = 1;
+}
+
+static void br(int r, BB *then, BB *els) {
+  IR *ir = new_ir(IR_BR);
+  ir->a = r;
+  ir->then = then;
+  ir->els = els;
+  cur->succ[0] = then;
+  cur->succ[1] = els;
+  cur->nsucc = 2;
+}
+
+// 式の値(を置いた仮想レジスタ)のスタック
+static int *vals;
+static int vals_len;
+static int vals_cap;
+
+static void push_val(int r) {
+  if (vals_len == vals_cap) {
+    vals_cap = vals_cap ? vals_cap * 2 : 256;
+    vals = realloc(vals, vals_cap * sizeof(int));
+  }
+  vals[vals_len++] = r;
+}
+
+static int pop_val(void) { return vals[--vals_len]; }
+
+/*
+  変換は再帰せず、作業用のスタックに積んだ仕事を順に処理する
+  1つのノードの処理は子の変換をはさんでいくつかの段階(phase)に分かれるので、
+  「次の段階」を積んでから子を積む(子が先に処理される)
+ */
+typedef struct {
+  NodeId id;
+  int phase;  // 次に行う段階
+  int seq;    // 制御文のブロックの番号(blocksの添字)
+} Work;
+
+static Work *work;
+static int work_len;
+static int work_cap;
+
+static void push_work(NodeId id, int phase, int seq) {
+  if (work_len == work_cap) {
+    work_cap = work_cap ? work_cap * 2 : 256;
+    work = realloc(work, work_cap * sizeof(Work));
+  }
+  work[work_len++] = (Work){id, phase, seq};
+}
+
+static void push_gen(NodeId id) { push_work(id, 0, 0); }
+
+// `id`から始まるリストを、先頭から順に処理されるように積む
+static void push_gen_list(NodeId id) {
+  int start = work_len;
+  for (; id; id = node_at(id)->next) push_gen(id);
+
+  for (int i = start, j = work_len - 1; i < j; i++, j--) {
+    Work tmp = work[i];
+    work[i] = work[j];
+    work[j] = tmp;
+  }
+}
+
+// 制御文で使うブロックを`n`個作り、最初のブロックの番号を返す
+static int new_bbs(int n) {
+  int seq = nblocks;
+  for (int i = 0; i < n; i++) new_bb();
+  return seq;
+}
+
+/*
+  命令選択: アドレスを求める部分木を、x86のアドレス指定
+  (ベース + 添字 * scale + disp)の形に当てはめる
+  ・ローカル変数は[rbp - offset]、グローバル変数は[名前]
+  ・メンバーは構造体のアドレス + メンバーのoffset
+  ・ポインタ + 定数は、ポインタ + 定数 * 要素の大きさ
+  ・ポインタ + 整数は、要素の大きさが1, 2, 4, 8なら添字にする
+  当てはまらない部分木は値を求めてベースにする
+ */
+typedef struct {
+  Var *var;      // アドレスの基点の変数(なければNULL)
+  NodeId base;   // 値をベースにする部分木(なければ0)
+  NodeId index;  // 値を添字にする部分木(なければ0)
+  int scale;
+  long disp;
+} Addr;
+
+static bool is_imm(NodeId id) {
+  Node *node = node_at(id);
+  return node->kind == ND_NUM && node->val == (int)node->val;
+}
+
+// ノード`id`のアドレス(is_valueが真なら、ポインタであるノードの値)を当てはめる
+// 当てはめ方は木だけで決まるので、変換の段階ごとに呼び直してよい
+static void match_addr(NodeId id, bool is_value, Addr *m) {
+  *m = (Addr){0};
+
+  for (;;) {
+    Node *node = node_at(id);
+    if (!is_value) {
+      switch (node->kind) {
+        case ND_VAR:
+          // 仮想レジスタに置いた変数はアドレスを取られないので、ここには来ない
+          assert(!node->var->vreg);
+          m->var = node->var;
+          return;
+        case ND_MEMBER:
+          m->disp += node->member->offset;
+          id = node->lhs;
+          continue;
+        case ND_DEREF:
+          is_value = true;
+          id = node->lhs;
+          continue;
+      }
+      error_tok(node->tok, "not an lvalue");
+    }
+
+    switch (node->kind) {
+      case ND_VAR:
+      case ND_MEMBER:
+      case ND_DEREF:
+        // 配列は先頭のアドレスになる
+        if (node->ty->kind == TY_ARRAY) {
+          is_value = false;
+          continue;
+        }
+        break;
+      case ND_PTR_ADD:
+      case ND_PTR_SUB: {
+        long size = node->ty->base->size;
+        if (is_imm(node->rhs)) {
+          long val = node_at(node->rhs)->val;
+          long disp = m->disp + (node->kind == ND_PTR_ADD ? val : -val) * size;
+          if (disp != (int)disp) break;
+          m->disp = disp;
+          id = node->lhs;
+          continue;
+        }
+        if (node->kind == ND_PTR_ADD && !m->index &&
+            (size == 1 || size == 2 || size == 4 || size == 8)) {
+          m->index = node->rhs;
+          m->scale = size;
+          id = node->lhs;
+          continue;
+        }
+        break;
+      }
+    }
+    m->base = id;
+    return;
+  }
+}
+
+// 当てはめたアドレスのベースと添字を求める仕事を積む(ベースが先に求まる)
+static void push_addr_operands(Addr *m) {
+  if (m->index) push_gen(m->index);
+  if (m->base) push_gen(m->base);
+}
+
+// 求めたベースと添字を取り出して、命令`ir`のアドレスにする
+static void set_addr(IR *ir, Addr *m) {
+  ir->index = m->index ? pop_val() : 0;
+  ir->a = m->base ? pop_val() : 0;
+  ir->var = m->var;
+  ir->disp = m->disp;
+  ir->scale = m->scale;
+}
+
+// アドレスを値として求める。ベースだけなら、その値をそのまま使う
+static void gen_lea(Addr *m) {
+  if (m->base && !m->index && !m->disp) return;
+  IR *ir = new_ir(IR_LEA);
+  set_addr(ir, m);
+  ir->d = new_reg();
+  push_val(ir->d);
+}
+
+// アドレスから型`ty`の値を読む。配列と構造体はアドレスのまま使う
+static void load(Addr *m, Type *ty) {
+  if (ty->kind == TY_ARRAY || ty->kind == TY_STRUCT) {
+    gen_lea(m);
+    return;
+  }
+  IR *ir = new_ir(IR_LOAD);
+  set_addr(ir, m);
+  ir->d = new_reg();
+  ir->size = ty->size;
+  push_val(ir->d);
+}
+
+// アドレス`src`から`size`バイトを、当てはめたアドレスに写す
+// 8, 4, 2, 1バイトずつ読み書きする
+static void copy_struct(Addr *m, int src, int size) {
+  IR dst = {0};
+  set_addr(&dst, m);
+
+  for (int off = 0; off < size;) {
+    int n = 8;
+    while (n > size - off) n /= 2;
+
+    IR *ld = new_ir(IR_LOAD);
+    ld->a = src;
+    ld->disp = off;
+    ld->d = new_reg();
+    ld->size = n;
+
+    IR *st = new_ir(IR_STORE);
+    st->a = dst.a;
+    st->index = dst.index;
+    st->var = dst.var;
+    st->disp = dst.disp + off;
+    st->scale = dst.scale;
+    st->b = ld->d;
+    st->size = n;
+    off += n;
+  }
+}
+
+/*
+  二項演算の片方を即値にできるか。1なら右辺、2なら(入れ替えてよい演算の)左辺
+  ポインタの加減算は、要素の大きさを掛けた値が32ビットに収まる場合に限る
+ */
+static int imm_side(Node *node) {
+  switch (node->kind) {
+    case ND_DIV:
+    case ND_PTR_DIFF:
+      return 0;
+    case ND_PTR_ADD:
+    case ND_PTR_SUB: {
+      if (!is_imm(node->rhs)) return 0;
+      long val = node_at(node->rhs)->val * node->ty->base->size;
+      return val == (int)val;
+    }
+    case ND_ADD:
+    case ND_MUL:
+    case ND_EQ:
+    case ND_NE:
+      if (!is_imm(node->rhs) && is_imm(node->lhs)) return 2;
+  }
+  return is_imm(node->rhs);
+}
+
+static IROp binary_op[] = {
+    [ND_ADD] = IR_ADD, [ND_PTR_ADD] = IR_ADD, [ND_SUB] = IR_SUB,
+    [ND_PTR_SUB] = IR_SUB, [ND_MUL] = IR_MUL, [ND_DIV] = IR_DIV,
+    [ND_EQ] = IR_EQ,   [ND_NE] = IR_NE,       [ND_LT] = IR_LT,
+    [ND_LE] = IR_LE,
+};
+
+// 片方が即値の二項演算。もう片方の値を求めた後の処理
+static void gen_binary_imm(Node *node, int side) {
+  long imm = node_at(side == 1 ? node->rhs : node->lhs)->val;
+  if (node->kind == ND_PTR_ADD || node->kind == ND_PTR_SUB)
+    imm *= node->ty->base->size;
+  push_val(new_op_imm(binary_op[node->kind], pop_val(), imm));
+}
+
+// 二項演算子の両辺を求めた後の処理
+static void gen_binary(Node *node) {
+  int rhs = pop_val();
+  int lhs = pop_val();
+
+  switch (node->kind) {
+    case ND_ADD:
+      push_val(new_op(IR_ADD, lhs, rhs));
+      return;
+    case ND_PTR_ADD:
+      rhs = new_op_imm(IR_MUL, rhs, node->ty->base->size);
+      push_val(new_op(IR_ADD, lhs, rhs));
+      return;
+    case ND_SUB:
+      push_val(new_op(IR_SUB, lhs, rhs));
+      return;
+    case ND_PTR_SUB:
+      rhs = new_op_imm(IR_MUL, rhs, node->ty->base->size);
+      push_val(new_op(IR_SUB, lhs, rhs));
+      return;
+    case ND_PTR_DIFF: {
+      int diff = new_op(IR_SUB, lhs, rhs);
+      int size = new_imm(node_at(node->lhs)->ty->base->size);
+      push_val(new_op(IR_DIV, diff, size));
+      return;
+    }
+    case ND_MUL:
+      push_val(new_op(IR_MUL, lhs, rhs));
+      return;
+    case ND_DIV:
+      push_val(new_op(IR_DIV, lhs, rhs));
+      return;
+    case ND_EQ:
+      push_val(new_op(IR_EQ, lhs, rhs));
+      return;
+    case ND_NE:
+      push_val(new_op(IR_NE, lhs, rhs));
+      return;
+    case ND_LT:
+      push_val(new_op(IR_LT, lhs, rhs));
+      return;
+    case ND_LE:
+      push_val(new_op(IR_LE, lhs, rhs));
+      return;
+  }
+}
+
+// 引数を求めた後の関数呼び出し
+static void gen_funcall(Node *node) {
+  int nargs = 0;
+  for (NodeId arg = node->args; arg; arg = node_at(arg)->next) nargs++;
+
+  if (nargs > 6) error_tok(node->tok, "too many arguments");
+
+  IR *ir = new_ir(IR_CALL);
+  ir->funcname = node->funcname;
+  ir->nargs = nargs;
+  ir->args = arena_alloc(nargs * sizeof(int));
+  for (int i = nargs - 1; i >= 0; i--) ir->args[i] = pop_val();
+  ir->d = new_reg();
+  push_val(ir->d);
+}
+
+// 1段階分を変換する
+static void gen_step(Work *w) {
+  NodeId id = w->id;
+  Node *node = node_at(id);
+  int phase = w->phase;
+  int seq = w->seq;
+
+  // 次の段階を積む。子はこの後に積むので、子の方が先に処理される
+#define NEXT() push_work(id, phase + 1, seq)
+
+  switch (node->kind) {
+    case ND_NULL:
+      return;
+    case ND_NUM:
+      push_val(new_imm(node->val));
+      return;
+    case ND_EXPR_STMT:
+      if (phase == 0) {
+        NEXT();
+        push_gen(node->lhs);
+        return;
+      }
+      pop_val();
+      return;
+    case ND_VAR:
+      if (node->var->vreg) {
+        // 後で変数に代入されても変わらないように、値を写しておく
+        push_val(new_op(IR_MOV, node->var->vreg, 0));
+        return;
+      }
+      // fallthrough
+    case ND_MEMBER:
+    case ND_DEREF: {
+      Addr m;
+      match_addr(id, false, &m);
+      if (phase == 0) {
+        NEXT();
+        push_addr_operands(&m);
+        return;
+      }
+      load(&m, node->ty);
+      return;
+    }
+    case ND_ASSIGN: {
+      Node *lhs = node_at(node->lhs);
+      Var *var = lhs->kind == ND_VAR ? lhs->var : NULL;
+      Addr m;
+      if (!var || !var->vreg) {
+        if (lhs->ty->kind == TY_ARRAY) error_tok(lhs->tok, "not an lvalue");
+        match_addr(node->lhs, false, &m);
+      }
+      if (phase == 0) {
+        NEXT();
+        push_gen(node->rhs);
+        if (!var || !var->vreg) push_addr_operands(&m);
+        return;
+      }
+
+      // 式の値は、代入する前の(切り詰めていない)値になる
+      int val = pop_val();
+      if (node->ty->kind == TY_STRUCT) {
+        // 構造体の値はアドレスなので、中身を写す
+        copy_struct(&m, val, node->ty->size);
+        push_val(val);
+        return;
+      }
+
+      IR *ir;
+      if (var && var->vreg) {
+        // メモリに置いた場合と同じく、型の大きさに切り詰めて符号拡張する
+        ir = new_ir(IR_SEXT);
+        ir->d = var->vreg;
+        ir->a = val;
+      } else {
+        ir = new_ir(IR_STORE);
+        set_addr(ir, &m);
+        ir->b = val;
+      }
+      ir->size = node->ty->size;
+      push_val(val);
+      return;
+    }
+    case ND_ADDR: {
+      Addr m;
+      match_addr(node->lhs, false, &m);
+      if (phase == 0) {
+        NEXT();
+        push_addr_operands(&m);
+        return;
+      }
+      gen_lea(&m);
+      return;
+    }
+    case ND_PTR_ADD:
+    case ND_PTR_SUB: {
+      // アドレス指定に当てはまれば、leaで求める
+      Addr m;
+      match_addr(id, true, &m);
+      if (m.base == id) break;
+      if (phase == 0) {
+        NEXT();
+        push_addr_operands(&m);
+        return;
+      }
+      gen_lea(&m);
+      return;
+    }
+    case ND_IF:
+      // blocks[seq]: then節, blocks[seq+1]: else節, blocks[seq+2]: 終わり
+      switch (phase) {
+        case 0:
+          seq = new_bbs(3);
+          NEXT();
+          push_gen(node->cond);
+          return;
+        case 1:
+          br(pop_val(), blocks[seq], blocks[node->els ? seq + 1 : seq + 2]);
+          start_bb(blocks[seq]);
+          NEXT();
+          push_gen(node->then);
+          return;
+        case 2:
+          jmp(blocks[seq + 2]);
+          if (node->els) {
+            start_bb(blocks[seq + 1]);
+            NEXT();
+            push_gen(node->els);
+            return;
+          }
+          start_bb(blocks[seq + 2]);
+          return;
+        default:
+          jmp(blocks[seq + 2]);
+          start_bb(blocks[seq + 2]);
+          return;
+      }
+    case ND_WHILE:
+      // blocks[seq]: 条件, blocks[seq+1]: 本体, blocks[seq+2]: 終わり
+      switch (phase) {
+        case 0:
+          seq = new_bbs(3);
+          jmp(blocks[seq]);
+          start_bb(blocks[seq]);
+          NEXT();
+          push_gen(node->cond);
+          return;
+        case 1:
+          br(pop_val(), blocks[seq + 1], blocks[seq + 2]);
+          start_bb(blocks[seq + 1]);
+          NEXT();
+          push_gen(node->then);
+          return;
+        default:
+          jmp(blocks[seq]);
+          start_bb(blocks[seq + 2]);
+          return;
+      }
+    case ND_FOR:
+      // blocks[seq]: 条件, blocks[seq+1]: 本体, blocks[seq+2]: 更新,
+      // blocks[seq+3]: 終わり
+      switch (phase) {
+        case 0:
+          seq = new_bbs(4);
+          NEXT();
+          if (node->init) push_gen(node->init);
+          return;
+        case 1:
+          jmp(blocks[seq]);
+          start_bb(blocks[seq]);
+          NEXT();
+          if (node->cond) push_gen(node->cond);
+          return;
+        case 2:
+          if (node->cond)
+            br(pop_val(), blocks[seq + 1], blocks[seq + 3]);
+          else
+            jmp(blocks[seq + 1]);
+          start_bb(blocks[seq + 1]);
+          NEXT();
+          push_gen(node->then);
+          return;
+        case 3:
+          jmp(blocks[seq + 2]);
+          start_bb(blocks[seq + 2]);
+          NEXT();
+          if (node->inc) push_gen(node->inc);
+          return;
+        default:
+          jmp(blocks[seq]);
+          start_bb(blocks[seq + 3]);
+          return;
+      }
+    case ND_BLOCK:
+    case ND_STMT_EXPR:
+      push_gen_list(node->body);
+      return;
+    case ND_FUNCALL:
+      if (phase == 0) {
+        NEXT();
+        push_gen_list(node->args);
+        return;
+      }
+      gen_funcall(node);
+      return;
+    case ND_RETURN:
+      if (phase == 0) {
+        NEXT();
+        push_gen(node->lhs);
+        return;
+      }
+      new_ir(IR_RET)->a = pop_val();
+      // この後の文には到達しないが、命令を置くブロックは必要
+      start_bb(new_bb());
+      return;
+  }
+
+  int side = imm_side(node);
+  if (phase == 0) {
+    NEXT();
+    if (side != 1) push_gen(node->rhs);
+    if (side != 2) push_gen(node->lhs);
+    return;
+  }
+  if (side)
+    gen_binary_imm(node, side);
+  else
+    gen_binary(node);
+#undef NEXT
+}
+
+// 文`id`を変換する
+static void gen(NodeId id) {
+  work_len = 0;
+  vals_len = 0;
+  push_gen(id);
+
+  while (work_len) {
+    Work w = work[--work_len];
+    gen_step(&w);
+  }
+}
+
+static NodeId *stack;
+static int stack_len;
+static int stack_cap;
+
+static void push_node(NodeId id) {
+  if (stack_len == stack_cap) {
+    stack_cap = stack_cap ? stack_cap * 2 : 256;
+    stack = realloc(stack, stack_cap * sizeof(NodeId));
+  }
+  stack[stack_len++] = id;
+}
+
+// アドレスを取られたローカル変数に印を付ける。それ以外のスカラーは仮想レジスタに置く
+static void mark_addr_taken(void) {
+  for (VarList *vl = fn->locals; vl; vl = vl->next) vl->var->addr_taken = false;
+
+  stack_len = 0;
+  for (NodeId n = fn->node; n; n = node_at(n)->next) push_node(n);
+
+  while (stack_len) {
+    Node *node = node_at(stack[--stack_len]);
+    if (node->kind == ND_ADDR && node_at(node->lhs)->kind == ND_VAR)
+      node_at(node->lhs)->var->addr_taken = true;
+    visit_children(node, push_node);
+  }
+}
+
+// 関数`f`を中間表現に変換し、f->bbsに入れる
+void gen_ir(Function *f) {
+  fn = f;
+  fn->bbs = NULL;
+  fn->nvregs = 0;
+  last_bb = NULL;
+  nblocks = 0;
+
+  // 仮想レジスタに置く変数を決める
+  mark_addr_taken();
+  for (VarList *vl = fn->locals; vl; vl = vl->next) {
+    Var *var = vl->var;
+    bool scalar = is_integer(var->ty) || var->ty->kind == TY_PTR;
+    var->vreg = !var->addr_taken && scalar ? new_reg() : 0;
+  }
+
+  start_bb(new_bb());
+  for (NodeId node = fn->node; node; node = node_at(node)->next) gen(node);
+}
+
+static char *op_name[] = {
+    [IR_ADD] = "add", [IR_SUB] = "sub", [IR_MUL] = "mul", [IR_DIV] = "div",
+    [IR_EQ] = "eq",   [IR_NE] = "ne",   [IR_LT] = "lt",   [IR_LE] = "le",
+};
+
+// アドレスを[&x + v1 + v2*4 + 8]の形で書く
+static void print_addr(IR *ir) {
+  fprintf(stderr, "[");
+  if (ir->var)
+    fprintf(stderr, "&%s", ir->var->name);
+  else
+    fprintf(stderr, "v%d", ir->a);
+  if (ir->index) fprintf(stderr, " + v%d*%d", ir->index, ir->scale);
+  if (ir->disp) fprintf(stderr, " + %d", ir->disp);
+  fprintf(stderr, "]");
+}
+
+// 中間表現を標準エラー出力に書く(--dump-ir)
+void print_ir(Function *fn) {
+  fprintf(stderr, "%s(", fn->name);
+  for (VarList *vl = fn->params; vl; vl = vl->next) {
+    Var *var = vl->var;
+    if (var->vreg)
+      fprintf(stderr, "v%d", var->vreg);
+    else
+      fprintf(stderr, "%s", var->name);
+    if (vl->next) fprintf(stderr, ", ");
+  }
+  fprintf(stderr, "):\n");
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    fprintf(stderr, ".L.bb.%d:\n", bb->label);
+
+    for (int i = 0; i < bb->len; i++) {
+      IR *ir = &bb->ir[i];
+      fprintf(stderr, "  ");
+      switch (ir->op) {
+        case IR_IMM:
+          fprintf(stderr, "v%d = %ld\n", ir->d, ir->imm);
+          break;
+        case IR_MOV:
+          fprintf(stderr, "v%d = v%d\n", ir->d, ir->a);
+          break;
+        case IR_LEA:
+          fprintf(stderr, "v%d = lea ", ir->d);
+          print_addr(ir);
+          fprintf(stderr, "\n");
+          break;
+        case IR_LOAD:
+          fprintf(stderr, "v%d = load%d ", ir->d, ir->size);
+          print_addr(ir);
+          fprintf(stderr, "\n");
+          break;
+        case IR_STORE:
+          fprintf(stderr, "store%d ", ir->size);
+          print_addr(ir);
+          fprintf(stderr, ", v%d\n", ir->b);
+          break;
+        case IR_SEXT:
+          fprintf(stderr, "v%d = sext%d v%d\n", ir->d, ir->size, ir->a);
+          break;
+        case IR_CALL:
+          fprintf(stderr, "v%d = call %s(", ir->d, ir->funcname);
+          for (int j = 0; j < ir->nargs; j++)
+            fprintf(stderr, "%sv%d", j ? ", " : "", ir->args[j]);
+          fprintf(stderr, ")\n");
+          break;
+        case IR_RET:
+          fprintf(stderr, "ret v%d\n", ir->a);
+          break;
+        case IR_JMP:
+          fprintf(stderr, "jmp .L.bb.%d\n", ir->then->label);
+          break;
+        case IR_BR:
+          fprintf(stderr, "br v%d, .L.bb.%d, .L.bb.%d\n", ir->a,
+                  ir->then->label, ir->els->label);
+          break;
+        default:
+          fprintf(stderr, "v%d = %s v%d, ", ir->d, op_name[ir->op], ir->a);
+          if (ir->b)
+            fprintf(stderr, "v%d\n", ir->b);
+          else
+            fprintf(stderr, "%ld\n", ir->imm);
+      }
+    }
+  }
+}
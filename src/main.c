@@ -1,15 +1,20 @@
 #include "./9cc.h"
 
-// 指定されたファイルの内容を返す
-static char *read_file(char *path) {
-  // ファイルを開く
-  FILE *fp = fopen(path, "r");
-  if (!fp) error("cannot open %s: %s", path, strerror(errno));
+// ストリームを終端まで読み込んで返す。サイズの上限はない
+// パイプや標準入力のようにmmapできない入力に使う
+static char *read_stream(FILE *fp, char *path) {
+  size_t cap = 64 * 1024;
+  size_t size = 0;
+  char *buf = malloc(cap);
 
-  int filemax = 10 * 1024 * 1024;
-  char *buf = malloc(filemax);
-  int size = fread(buf, 1, filemax - 2, fp);
-  if (!feof(fp)) error("%s: file too large");
+  for (;;) {
+    // 末尾の"\n\0"の分は常に空けておく
+    if (cap - size < 4096 + 2) buf = realloc(buf, cap *= 2);
+    size_t n = fread(buf + size, 1, cap - size - 2, fp);
+    if (n == 0) break;
+    size += n;
+  }
+  if (ferror(fp)) error("cannot read %s: %s", path, strerror(errno));
 
   // ファイルが必ず"\n\0"で終わっているようにする
   if (size == 0 || buf[size - 1] != '\n') buf[size++] = '\n';
@@ -17,6 +22,75 @@ static char *read_file(char *path) {
   return buf;
 }
 
+static size_t mapped_len;  // 入力をマップした場合、その大きさ
+
+// ファイルを読み取り専用でメモリにマップして返す。マップできなければNULL
+static char *map_file(int fd, size_t size) {
+  size_t pagesz = sysconf(_SC_PAGESIZE);
+
+  // "\n\0"を置く2バイトを含めた領域を0埋めの無名ページで確保し、
+  // その先頭にファイルを重ねてマップする
+  size_t maplen = (size + 2 + pagesz - 1) & ~(pagesz - 1);
+  char *buf = mmap(NULL, maplen, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED) return NULL;
+
+  if (size > 0 && mmap(buf, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd,
+                       0) == MAP_FAILED) {
+    munmap(buf, maplen);
+    return NULL;
+  }
+
+  // ファイル末尾以降は最終ページの残りも含めてカーネルが0で埋めるので、
+  // '\0'は書かなくても既にある。改行で終わっていない場合だけ、
+  // 改行を書き込むページを書き込み可能にする(コピーされるのはその1ページのみ)
+  if (size == 0 || buf[size - 1] != '\n') {
+    char *page = buf + (size & ~(pagesz - 1));
+    if (mprotect(page, pagesz, PROT_READ | PROT_WRITE))
+      error("mprotect: %s", strerror(errno));
+    buf[size] = '\n';
+  }
+  mapped_len = maplen;
+  return buf;
+}
+
+// 指定されたファイルの内容を返す。"-"の場合は標準入力を読む
+static char *read_file(char *path) {
+  mapped_len = 0;
+  if (!strcmp(path, "-")) return read_stream(stdin, path);
+
+  // ファイルを開く
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) error("cannot open %s: %s", path, strerror(errno));
+
+  struct stat st;
+  if (fstat(fd, &st)) error("cannot stat %s: %s", path, strerror(errno));
+
+  // 通常のファイルはマップする。それ以外は普通に読み込む
+  char *buf = NULL;
+  if (S_ISREG(st.st_mode)) buf = map_file(fd, st.st_size);
+
+  if (!buf) {
+    FILE *fp = fdopen(fd, "r");
+    if (!fp) error("cannot open %s: %s", path, strerror(errno));
+    buf = read_stream(fp, path);
+    fclose(fp);
+    return buf;
+  }
+
+  // マップはファイルを閉じた後も有効
+  close(fd);
+  return buf;
+}
+
+// read_fileで読んだ内容を解放する
+static void release_file(char *buf) {
+  if (mapped_len)
+    munmap(buf, mapped_len);
+  else
+    free(buf);
+}
+
 int align_to(int n, int align) {
   // 10 = 1010
   // alignに8を渡すと-1で７(0111)。ビット反転され8(1000)に。
@@ -24,30 +98,120 @@ int align_to(int n, int align) {
   return (n + align - 1) & ~(align - 1);
 }
 
-int main(int argc, char **argv) {
-  if (argc != 2) error("%s: 引数の個数が正しくありません", argv[0]);
+int lex_threads = 1;    // 字句解析に使うスレッド数
+int max_errors = 20;    // 1回のコンパイルで報告する構文エラーの最大数
+bool stream_lex;        // 構文解析が必要とした分だけ字句解析を進める
+bool reorder_fields;    // 詰め物が少なくなるように構造体のメンバーを並べ替える
+bool dump_ir;           // 中間表現を標準エラー出力に書く
+bool peephole_stats;    // 覗き穴最適化で消した命令の数を標準エラー出力に書く
+static bool mem_stats;  // 最大のメモリ使用量(RSS)を標準エラー出力に書く
+static char *output;    // 出力先のファイル。NULLなら標準出力
+
+// コマンドライン引数を解釈し、入力ファイルのパスを`paths`に入れてその数を返す
+static int parse_args(int argc, char **argv, char **paths) {
+  int npaths = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strncmp(argv[i], "--lex-threads=", 14)) {
+      lex_threads = atoi(argv[i] + 14);
+      if (lex_threads < 1) error("%s: 不正なスレッド数です", argv[i]);
+      continue;
+    }
 
+    if (!strcmp(argv[i], "--stream-lex")) {
+      stream_lex = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--reorder-fields")) {
+      reorder_fields = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--dump-ir")) {
+      dump_ir = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--peephole-stats")) {
+      peephole_stats = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--mem-stats")) {
+      mem_stats = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-o")) {
+      if (i + 1 == argc) error("-o: 出力先のファイルがありません");
+      output = argv[++i];
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-o", 2)) {
+      output = argv[i] + 2;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "--max-errors=", 13)) {
+      max_errors = atoi(argv[i] + 13);
+      if (max_errors < 1) error("%s: 不正なエラー数です", argv[i]);
+      continue;
+    }
+
+    if (argv[i][0] == '-' && argv[i][1]) error("unknown argument: %s", argv[i]);
+
+    paths[npaths++] = argv[i];
+  }
+
+  if (!npaths) error("%s: 引数の個数が正しくありません", argv[0]);
+  if (stream_lex && lex_threads > 1)
+    error("--stream-lex and --lex-threads cannot be used together");
+  return npaths;
+}
+
+// 1つの翻訳単位をコンパイルし、アセンブリを出力する
+static void compile_unit(char *path) {
   // トークナイズしてパースする
   // 結果はcodeに保存される
-  filename = argv[1];
-  user_input = read_file(argv[1]);
-  token = tokenize();
+  filename = path;
+  user_input = read_file(filename);
+  tokenize();
   Program *prog = program();
+  optimize(prog);
 
-  // ローカル変数の個数分オフセット(メモリ領域)を割り当てる
+  // 中間表現に変換し、仮想レジスタの置き場所とフレームの配置を決める
   for (Function *fn = prog->fns; fn; fn = fn->next) {
-    int offset = 0;
-    for (VarList *vl = fn->locals; vl; vl = vl->next) {
-      Var *var = vl->var;
-      offset += var->ty->size;
-      var->offset = offset;
-    }
-
-    fn->stack_size = align_to(offset, 8);
+    gen_ir(fn);
+    if (dump_ir) print_ir(fn);
+    alloc_regs(fn);
   }
 
-  // ASTをトラバースしてアセンブリを出す
+  // 中間表現からアセンブリを出す
   codegen(prog);
 
+  // 出力し終えたので、構文木や型、識別子の名前や文字列リテラルをまとめて捨てる
+  // 次の翻訳単位は同じ領域を使い回すので、単位の数が増えてもメモリは増えない
+  arena_reset();
+  reset_types();
+  release_file(user_input);
+}
+
+int main(int argc, char **argv) {
+  char **paths = calloc(argc, sizeof(char *));
+  int npaths = parse_args(argc, argv, paths);
+
+  // 複数の入力は順にコンパイルし、アセンブリを連結して出力する
+  emit_open(output);
+  for (int i = 0; i < npaths; i++) compile_unit(paths[i]);
+  emit_close();
+  if (peephole_stats) print_peephole_stats();
+
+  if (mem_stats) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    fprintf(stderr, "memory: max rss %ld KiB\n", ru.ru_maxrss);
+  }
   return 0;
 }
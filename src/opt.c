@@ -0,0 +1,347 @@
+#include "./9cc.h"
+
+//
+// 注釈：
+// 構文木の最適化。program()の後、codegen()の前に行う
+// ・定数の畳み込み: 両辺が定数(ND_NUM)の整数演算・比較を、結果の定数に置き換える
+// ・定数の伝播: 定数を1回だけ代入され、アドレスを取られないローカル変数の
+//   読み出しを、その定数に置き換える
+// ・条件が定数のif/while/forを簡単にする
+// ・不要なコードの削除: return以降の到達しない文、副作用のない式文、
+//   読み出されないローカル変数とその代入を取り除く
+// (sizeofはパースの時点で定数になっている)
+//
+
+#define VISITED (1u << 31)
+
+static NodeId *order;  // 後順(子が親より先)に並べたノード
+static int order_len;
+static int order_cap;
+
+static NodeId *stack;
+static int stack_len;
+static int stack_cap;
+
+static void push_node(NodeId id) {
+  if (stack_len == stack_cap) {
+    stack_cap = stack_cap ? stack_cap * 2 : 256;
+    stack = realloc(stack, stack_cap * sizeof(NodeId));
+  }
+  stack[stack_len++] = id;
+}
+
+static void append_order(NodeId id) {
+  if (order_len == order_cap) {
+    order_cap = order_cap ? order_cap * 2 : 256;
+    order = realloc(order, order_cap * sizeof(NodeId));
+  }
+  order[order_len++] = id;
+}
+
+// 文のリスト`body`の全ノードを後順に並べてorderに入れる
+static void build_order(NodeId body) {
+  order_len = 0;
+  for (NodeId n = body; n; n = node_at(n)->next) push_node(n);
+
+  while (stack_len) {
+    NodeId top = stack[stack_len - 1];
+    if (top & VISITED) {
+      stack_len--;
+      append_order(top & ~VISITED);
+      continue;
+    }
+    stack[stack_len - 1] = top | VISITED;
+    visit_children(node_at(top), push_node);
+  }
+}
+
+static bool is_num(NodeId id) { return id && node_at(id)->kind == ND_NUM; }
+
+// ノードを定数`val`に置き換える。型とトークンはそのまま残す
+static void set_num(Node *node, long val) {
+  node->kind = ND_NUM;
+  node->lhs = 0;
+  node->rhs = 0;
+  node->val = val;
+}
+
+// 両辺が定数の二項演算を畳み込む
+// 実行時と同じく64ビットで計算する(あふれた場合は2の補数で折り返す)
+static void fold_binary(Node *node) {
+  if (!is_num(node->lhs) || !is_num(node->rhs)) return;
+  unsigned long a = node_at(node->lhs)->val;
+  unsigned long b = node_at(node->rhs)->val;
+
+  switch (node->kind) {
+    case ND_ADD:
+      set_num(node, a + b);
+      return;
+    case ND_SUB:
+      set_num(node, a - b);
+      return;
+    case ND_MUL:
+      set_num(node, a * b);
+      return;
+    case ND_DIV:
+      // 0除算とオーバーフローは実行時に(idivで)起こす
+      if (b == 0 || ((long)a == LONG_MIN && (long)b == -1)) return;
+      set_num(node, (long)a / (long)b);
+      return;
+    case ND_EQ:
+      set_num(node, a == b);
+      return;
+    case ND_NE:
+      set_num(node, a != b);
+      return;
+    case ND_LT:
+      set_num(node, (long)a < (long)b);
+      return;
+    case ND_LE:
+      set_num(node, (long)a <= (long)b);
+      return;
+  }
+}
+
+// 文`node`を文`id`(0なら空文)で置き換える。リストのつながりはそのまま
+static void replace_stmt(Node *node, NodeId id) {
+  NodeId next = node->next;
+  if (id)
+    *node = *node_at(id);
+  else
+    *node = (Node){.kind = ND_NULL, .tok = node->tok};
+  node->next = next;
+}
+
+// 条件が定数の制御文を簡単にする
+static void fold_control(Node *node) {
+  switch (node->kind) {
+    case ND_IF:
+      if (!is_num(node->cond)) return;
+      replace_stmt(node, node_at(node->cond)->val ? node->then : node->els);
+      return;
+    case ND_WHILE:
+      if (!is_num(node->cond)) return;
+      if (!node_at(node->cond)->val) {
+        replace_stmt(node, 0);
+        return;
+      }
+      // 条件が常に真なら、条件を調べない無限ループにする
+      node->kind = ND_FOR;
+      node->cond = 0;
+      node->init = 0;
+      node->inc = 0;
+      return;
+    case ND_FOR:
+      if (!is_num(node->cond)) return;
+      if (!node_at(node->cond)->val)
+        replace_stmt(node, node->init);
+      else
+        node->cond = 0;
+      return;
+  }
+}
+
+// orderのノードを順に畳み込む。子が先に来るので、畳み込みは下から伝わる
+static void fold_all(void) {
+  for (int i = 0; i < order_len; i++) {
+    Node *node = node_at(order[i]);
+    fold_binary(node);
+    fold_control(node);
+  }
+}
+
+// 変数の型に合わせて値を切り詰める(読み出すときの符号拡張と同じ結果になる)
+static long truncate_to(Type *ty, long val) {
+  switch (ty->size) {
+    case 1:
+      return (signed char)val;
+    case 2:
+      return (short)val;
+    case 4:
+      return (int)val;
+  }
+  return val;
+}
+
+// ローカル変数の代入・読み出し・アドレスの取得を数える
+static void count_uses(Function *fn) {
+  for (VarList *vl = fn->locals; vl; vl = vl->next) {
+    Var *var = vl->var;
+    var->nassigns = 0;
+    var->nreads = 0;
+    var->addr_taken = false;
+    var->def = 0;
+  }
+  for (VarList *vl = fn->params; vl; vl = vl->next) vl->var->nassigns = 1;
+
+  for (int i = 0; i < order_len; i++) {
+    Node *node = node_at(order[i]);
+    switch (node->kind) {
+      case ND_VAR:
+        node->var->nreads++;
+        break;
+      case ND_ASSIGN: {
+        Node *lhs = node_at(node->lhs);
+        if (lhs->kind != ND_VAR) break;
+        lhs->var->nreads--;  // 代入先はND_VARとして数えてしまっている
+        lhs->var->nassigns++;
+        lhs->var->def = order[i];
+        break;
+      }
+      case ND_ADDR: {
+        Node *lhs = node_at(node->lhs);
+        if (lhs->kind == ND_VAR) lhs->var->addr_taken = true;
+        break;
+      }
+    }
+  }
+}
+
+// 定数を伝播できる変数か
+static bool is_const_var(Var *var) {
+  return var->is_local && is_integer(var->ty) && !var->addr_taken &&
+         var->nassigns == 1 && var->def && var->nreads > 0 &&
+         is_num(node_at(var->def)->rhs);
+}
+
+// 定数を伝播できる変数の読み出しを定数に置き換える。置き換えたらtrueを返す
+static bool propagate(void) {
+  bool changed = false;
+  for (int i = 0; i < order_len; i++) {
+    Node *node = node_at(order[i]);
+    if (node->kind != ND_VAR || !is_const_var(node->var)) continue;
+
+    Var *var = node->var;
+    Node *def = node_at(var->def);
+    if (def->lhs == order[i]) continue;  // 代入先はそのまま
+
+    set_num(node, truncate_to(var->ty, node_at(def->rhs)->val));
+    changed = true;
+  }
+  return changed;
+}
+
+// 式`id`に副作用がないか。代入・関数呼び出し・ステートメント式を含まなければ真
+static bool is_pure(NodeId id) {
+  stack_len = 0;
+  push_node(id);
+  while (stack_len) {
+    Node *node = node_at(stack[--stack_len]);
+    if (node->kind == ND_ASSIGN || node->kind == ND_FUNCALL ||
+        node->kind == ND_STMT_EXPR) {
+      stack_len = 0;
+      return false;
+    }
+    visit_children(node, push_node);
+  }
+  return true;
+}
+
+// 文`node`を実行すると必ずreturnするか(ブロックは最後の文で判断する)
+static bool always_returns(Node *node) {
+  while (node->kind == ND_BLOCK) {
+    if (!node->body) return false;
+    node = node_at(node->body);
+    while (node->next) node = node_at(node->next);
+  }
+  return node->kind == ND_RETURN;
+}
+
+// 読み出されないローカル変数か
+// アドレスを取られた変数は、"&x"をND_VARの読み出しとして数えているので含まない
+static bool is_dead_var(Node *node) {
+  return node->kind == ND_VAR && node->var->is_local && node->var->nreads == 0;
+}
+
+static bool changed;  // eliminateで構文木を書き換えたか
+
+// 式文を簡単にする。読み出されない変数への代入は右辺だけを残し、
+// 副作用のない式文は空文にする
+static void simplify_expr_stmt(Node *node) {
+  for (;;) {
+    Node *expr = node_at(node->lhs);
+    if (expr->kind != ND_ASSIGN || !is_dead_var(node_at(expr->lhs))) break;
+    node->lhs = expr->rhs;
+    changed = true;
+  }
+
+  if (is_pure(node->lhs)) {
+    node->kind = ND_NULL;
+    node->lhs = 0;
+    changed = true;
+  }
+}
+
+// 文のリストから空文を取り除く。`cut`が真なら、必ずreturnする文より後も捨てる
+// (ステートメント式の最後は式なので、空文になることはない)
+static void compact_list(NodeId *head, bool cut) {
+  for (NodeId *p = head; *p;) {
+    Node *node = node_at(*p);
+    if (node->kind == ND_NULL) {
+      *p = node->next;
+      changed = true;
+      continue;
+    }
+    if (cut && node->next && always_returns(node)) {
+      node->next = 0;
+      changed = true;
+    }
+    p = &node->next;
+  }
+}
+
+// 不要な文を取り除く。書き換えたらtrueを返す
+// orderは子が先なので、内側のブロックから順に片付く
+static bool eliminate(Function *fn) {
+  changed = false;
+  for (int i = 0; i < order_len; i++) {
+    Node *node = node_at(order[i]);
+    switch (node->kind) {
+      case ND_EXPR_STMT:
+        simplify_expr_stmt(node);
+        break;
+      case ND_BLOCK:
+        compact_list(&node->body, true);
+        break;
+      case ND_STMT_EXPR:
+        // 最後の式を残すため、return以降は捨てない
+        compact_list(&node->body, false);
+        break;
+      case ND_FOR:
+        if (node->init && node_at(node->init)->kind == ND_NULL) node->init = 0;
+        if (node->inc && node_at(node->inc)->kind == ND_NULL) node->inc = 0;
+        break;
+    }
+  }
+  compact_list(&fn->node, true);
+  return changed;
+}
+
+// 読み出しも代入もされなくなったローカル変数をfn->localsから外し、
+// スタックに領域を割り当てないようにする。引数は常に残る
+static void drop_dead_locals(Function *fn) {
+  for (VarList **p = &fn->locals; *p;) {
+    Var *var = (*p)->var;
+    if (var->nreads == 0 && var->nassigns == 0)
+      *p = (*p)->next;
+    else
+      p = &(*p)->next;
+  }
+}
+
+static void optimize_fn(Function *fn) {
+  // 伝播した定数で新たに畳み込める式や、定数になる変数ができ、
+  // 文を消すと読み出されなくなる変数ができるので、変化がなくなるまで繰り返す
+  for (;;) {
+    build_order(fn->node);
+    fold_all();
+    count_uses(fn);
+    if (propagate()) continue;
+    if (!eliminate(fn)) break;
+  }
+  drop_dead_locals(fn);
+}
+
+void optimize(Program *prog) {
+  for (Function *fn = prog->fns; fn; fn = fn->next) optimize_fn(fn);
+}
@@ -10,131 +10,262 @@
 // この配列に蓄積されます。
 static VarList *locals;
 static VarList *globals;
-static VarList *scope;
-
-// Find a local variable by name.
-static Var *find_var(Token *tok) {
-  for (VarList *vl = scope; vl; vl = vl->next) {
-    Var *var = vl->var;
-    if (strlen(var->name) == tok->len &&
-        !strncmp(tok->str, var->name, tok->len))
-      return var;
+
+/*
+  変数の有効範囲(スコープ)
+  宣言された変数はscope_varsに積み、名前から一番内側の変数の位置を
+  ハッシュ表scope_tabで引く。外側の同じ名前の変数はshadowで辿れるので、
+  ブロックを抜けるときは積んだ変数を降ろしながらハッシュ表を元に戻す
+  名前はinternされているので、ポインタそのものをキーにできる
+ */
+typedef struct {
+  Var *var;
+  int shadow;  // 同じ名前の1つ外側の変数の位置。なければ-1
+} ScopeVar;
+
+typedef struct {
+  char *name;  // NULLなら空き
+  int idx;     // 一番内側の変数のscope_varsでの位置。なければ-1
+} ScopeEntry;
+
+static ScopeVar *scope_vars;
+static int scope_len;
+static int scope_cap;
+
+static ScopeEntry *scope_tab;
+static int scope_tab_used;
+static int scope_tab_cap;
+
+// `name`の入る場所を返す。表になければ空きの場所を返す
+static ScopeEntry *scope_entry(char *name) {
+  int mask = scope_tab_cap - 1;
+  for (int i = name_hash(name) & mask;; i = (i + 1) & mask) {
+    ScopeEntry *e = &scope_tab[i];
+    if (!e->name || e->name == name) return e;
   }
-  return NULL;
 }
 
+static void grow_scope_tab(void) {
+  ScopeEntry *old = scope_tab;
+  int old_cap = scope_tab_cap;
+
+  scope_tab_cap = old_cap ? old_cap * 2 : 256;
+  scope_tab = calloc(scope_tab_cap, sizeof(ScopeEntry));
+  for (int i = 0; i < old_cap; i++)
+    if (old[i].name) *scope_entry(old[i].name) = old[i];
+  free(old);
+}
+
+// 変数を現在のスコープに加える
+static void push_scope(Var *var) {
+  if ((scope_tab_used + 1) * 2 > scope_tab_cap) grow_scope_tab();
+  if (scope_len == scope_cap) {
+    scope_cap = scope_cap ? scope_cap * 2 : 256;
+    scope_vars = realloc(scope_vars, scope_cap * sizeof(ScopeVar));
+  }
+
+  ScopeEntry *e = scope_entry(var->name);
+  if (!e->name) {
+    e->name = var->name;
+    e->idx = -1;
+    scope_tab_used++;
+  }
+  scope_vars[scope_len] = (ScopeVar){var, e->idx};
+  e->idx = scope_len++;
+}
+
+// ブロックに入るときの印を返す
+static int enter_scope(void) { return scope_len; }
+
+// enter_scopeの時点より後に加えた変数を取り除く
+static void leave_scope(int depth) {
+  while (scope_len > depth) {
+    ScopeVar *sv = &scope_vars[--scope_len];
+    scope_entry(sv->var->name)->idx = sv->shadow;
+  }
+}
+
+// Find a variable by name.
+static Var *find_var(Token tok) {
+  if (!scope_tab_cap) return NULL;
+  ScopeEntry *e = scope_entry(tok_ident(tok));
+  return e->name && e->idx >= 0 ? scope_vars[e->idx].var : NULL;
+}
+
+// ノードの置き場所。かたまりはアリーナから確保する
+Node **node_chunks;
+static int node_chunks_cap;
+static NodeId node_cnt;
+
 /* ノードの作成関数 */
-static Node *new_node(NodeKind kind, Token *tok) {
-  Node *node = calloc(1, sizeof(Node));
+static NodeId new_node(NodeKind kind, Token tok) {
+  NodeId id = node_cnt++;
+  int chunk = id >> NODE_CHUNK_BITS;
+
+  if ((id & (NODE_CHUNK - 1)) == 0) {
+    if (chunk == node_chunks_cap) {
+      node_chunks_cap = node_chunks_cap ? node_chunks_cap * 2 : 16;
+      node_chunks = realloc(node_chunks, node_chunks_cap * sizeof(Node *));
+    }
+    node_chunks[chunk] = arena_alloc(NODE_CHUNK * sizeof(Node));
+  }
+
+  Node *node = node_at(id);
+  *node = (Node){};
   node->kind = kind;
   node->tok = tok;
-  return node;
+  return id;
+}
+
+// ノードの置き場所を空にする。アリーナのリセットで、かたまりも捨てられる
+static void reset_nodes(void) {
+  node_cnt = 0;
+  new_node(ND_NULL, 0);  // 0番は「ノードなし」として予約
 }
 
 /* 二分木ノードの作成関数 */
-static Node *new_binary(NodeKind kind, Node *lhs, Node *rhs, Token *tok) {
-  Node *node = new_node(kind, tok);
-  node->lhs = lhs;
-  node->rhs = rhs;
-  return node;
+static NodeId new_binary(NodeKind kind, NodeId lhs, NodeId rhs, Token tok) {
+  NodeId id = new_node(kind, tok);
+  node_at(id)->lhs = lhs;
+  node_at(id)->rhs = rhs;
+  return id;
 }
 
 /* 左しかない木ノードの作成関数 */
-static Node *new_unary(NodeKind kind, Node *expr, Token *tok) {
-  Node *node = new_node(kind, tok);
-  node->lhs = expr;
-  return node;
+static NodeId new_unary(NodeKind kind, NodeId expr, Token tok) {
+  NodeId id = new_node(kind, tok);
+  node_at(id)->lhs = expr;
+  return id;
 }
 
 /* 整数ノードの作成関数 */
-static Node *new_num(long val, Token *tok) {
-  Node *node = new_node(ND_NUM, tok);
-  node->val = val;
-  return node;
+static NodeId new_num(long val, Token tok) {
+  NodeId id = new_node(ND_NUM, tok);
+  node_at(id)->val = val;
+  return id;
 }
 
 /* 変数ノード作成関数 */
-static Node *new_var_node(Var *var, Token *tok) {
-  Node *node = new_node(ND_VAR, tok);
-  node->var = var;
-  return node;
+static NodeId new_var_node(Var *var, Token tok) {
+  NodeId id = new_node(ND_VAR, tok);
+  node_at(id)->var = var;
+  return id;
 }
 
 /* 変数のノード作成関数 */
 static Var *new_var(char *name, Type *ty, bool is_local) {
-  Var *var = calloc(1, sizeof(Var));  // Varの構造体一つずつに1byteメモリを確保
+  Var *var = arena_alloc(sizeof(Var));
   var->name = name;
   var->ty = ty;
   var->is_local = is_local;
-
-  VarList *sc = calloc(1, sizeof(VarList));
-  sc->var = var;
-  sc->next = scope;
-  scope = sc;
   return var;
 }
 
 /* ローカル変数専用のノード作成関数 */
 static Var *new_lvar(char *name, Type *ty) {
   Var *var = new_var(name, ty, true);
+  push_scope(var);
 
   var->name = name;
   var->ty = ty;
 
-  VarList *vl = calloc(1, sizeof(VarList));
+  VarList *vl = arena_alloc(sizeof(VarList));
   vl->var = var;
   vl->next = locals;
   locals = vl;
   return var;
 }
 
-static Var *new_gvar(char *name, Type *ty) {
+// 文字列リテラルのように名前で参照されないものは、scopeに加えない
+static Var *new_gvar(char *name, Type *ty, bool in_scope) {
   Var *var = new_var(name, ty, false);
+  if (in_scope) push_scope(var);
 
-  VarList *vl = calloc(1, sizeof(VarList));
+  VarList *vl = arena_alloc(sizeof(VarList));
   vl->var = var;
   vl->next = globals;
   globals = vl;
   return var;
 }
 
+// ラベルの番号は翻訳単位をまたいで通しで振るので、出力を連結しても衝突しない
 static char *new_label(void) {
   static int cnt = 0;
-  char buf[20];
+  char *buf = arena_alloc(20);
   sprintf(buf, ".L.data.%d", cnt++);
-  return strndup(buf, 20);
+  return buf;
 }
 
 // forward declaration
 
-static Function *function(void);
+static Function *function(char *name);
 static Type *basetype(void);
 static Type *struct_decl(void);
 static Member *struct_member(void);
-static void global_var(void);
-static Node *declaration(void);
+static void global_var(Type *ty, char *name);
+static NodeId declaration(void);
 static bool is_typename(void);
-static Node *stmt(void);
-static Node *stmt2(void);
-static Node *expr(void);
-static Node *assign(void);
-static Node *equality(void);
-static Node *relational(void);
-static Node *add(void);
-static Node *mul(void);
-static Node *unary(void);
-static Node *postfix(void);
-static Node *primary(void);
+static NodeId stmt(void);
+static NodeId stmt2(void);
+static NodeId expr(void);
+static NodeId assign(void);
+static NodeId binary(int min_prec);
+static NodeId unary(void);
+static NodeId postfix(void);
+static NodeId primary(void);
+
+/*
+  構文エラーの後、次の文(または項目)の始まりと思われる位置までトークンを読み飛ばす。
+  `;`か、対応の取れた`}`の直後で止まる。対応の取れない`}`の手前でも止まる
+ */
+static void synchronize(void) {
+  int depth = 0;
+
+  for (; !at_eof(); next_token()) {
+    if (peek_id(TK_LBRACE)) {
+      depth++;
+    } else if (peek_id(TK_RBRACE)) {
+      if (depth == 0) return;
+      if (--depth == 0) {
+        next_token();
+        return;
+      }
+    } else if (depth == 0 && peek_id(TK_SEMI)) {
+      next_token();
+      return;
+    }
+  }
+}
 
 /*
-  次のトップレベルの項目が関数かグローバル変数かを、入力トークンを先読みして判断します。
+  トップレベルの項目を1つパースし、関数ならそれを返す。
+  構文エラーがあった場合は、その項目を読み飛ばしてNULLを返す
  */
-static bool is_function(void) {
-  Token *tok = token;
-  basetype();
-  bool isfunc = consume_ident() && consume("(");
-  token = tok;
-  return isfunc;
+static Function *toplevel(void) {
+  int sc = enter_scope();
+  jmp_buf buf;
+
+  if (setjmp(buf)) {
+    error_recovery = NULL;
+    leave_scope(sc);
+    synchronize();
+    consume_id(TK_RBRACE);  // 対応の取れない"}"も読み飛ばす
+    return NULL;
+  }
+
+  error_recovery = &buf;
+
+  // 型と名前は関数でもグローバル変数でも同じなので、一度だけパースし、
+  // 次のトークンが"("かどうかで分岐する
+  Function *fn = NULL;
+  Type *ty = basetype();
+  char *name = expect_ident();
+  if (consume_id(TK_LPAREN))
+    fn = function(name);
+  else
+    global_var(ty, name);
+  error_recovery = NULL;
+  return fn;
 }
 
 /*
@@ -145,43 +276,51 @@ Program *program(void) {
   Function head = {};
   Function *cur = &head;
   globals = NULL;
+  reset_nodes();
+  leave_scope(0);  // 前の翻訳単位のグローバル変数を取り除く
 
   while (!at_eof()) {
-    if (is_function()) {
-      cur->next = function();
+    Function *fn = toplevel();
+    if (fn) {
+      cur->next = fn;
       cur = cur->next;
-    } else {
-      global_var();
     }
   }
 
-  Program *prog = calloc(1, sizeof(Program));
+  // 構文エラーがあればここで終了する
+  if (error_count) exit(1);
+
+  Program *prog = arena_alloc(sizeof(Program));
   prog->globals = globals;
   prog->fns = head.next;
   return prog;
 }
 
-// basetype = ("char" | "int" | struct-decl) "*"*
+// basetype = ("char" | "short" | "int" | "long" | struct-decl) "*"*
 static Type *basetype(void) {
   if (!is_typename()) error_tok(token, "typename expected");
 
   Type *ty;
-  if (consume("char"))
+  if (consume_id(TK_CHAR))
     ty = char_type;
-  else if (consume("int"))
+  else if (consume_id(TK_SHORT))
+    ty = short_type;
+  else if (consume_id(TK_INT))
     ty = int_type;
+  else if (consume_id(TK_LONG))
+    ty = long_type;
   else
     ty = struct_decl();
 
-  while (consume("*")) ty = pointer_to(ty);
+  while (consume_id(TK_STAR)) ty = pointer_to(ty);
   return ty;
 }
 
 /* 次のトークンが[でない(つまり整数)ならそのまま、配列ならarray_ofを適用 */
 static Type *read_type_suffix(Type *base) {
-  if (!consume("[")) return base;
+  if (!consume_id(TK_LBRACKET)) return base;
   int sz = expect_number();
-  expect("]");
+  expect_id(TK_RBRACKET);
   base = read_type_suffix(base);
   return array_of(base, sz);
 }
@@ -189,39 +328,27 @@ static Type *read_type_suffix(Type *base) {
 // struct-decl = "struct" "{" struct-member "}"
 static Type *struct_decl(void) {
   // Read struct members.
-  expect("struct");
-  expect("{");
+  expect_id(TK_STRUCT);
+  expect_id(TK_LBRACE);
 
   Member head = {};
   Member *cur = &head;
 
-  while (!consume("}")) {
+  while (!consume_id(TK_RBRACE)) {
     cur->next = struct_member();
     cur = cur->next;
   }
 
-  Type *ty = calloc(1, sizeof(Type));
-  ty->kind = TY_STRUCT;
-  ty->members = head.next;
-
-  // Assign offsets within the struct to members.
-  int offset = 0;
-  for (Member *mem = ty->members; mem; mem = mem->next) {
-    mem->offset = offset;
-    offset += mem->ty->size;
-  }
-  ty->size = offset;
-
-  return ty;
+  return struct_type(head.next);
 }
 
 // struct-member = basetype ident ("[" num "]")* ";"
 static Member *struct_member(void) {
-  Member *mem = calloc(1, sizeof(Member));
+  Member *mem = arena_alloc(sizeof(Member));
   mem->ty = basetype();
   mem->name = expect_ident();
   mem->ty = read_type_suffix(mem->ty);
-  expect(";");
+  expect_id(TK_SEMI);
   return mem;
 }
 
@@ -230,21 +357,21 @@ static VarList *read_func_param(void) {
   char *name = expect_ident();
   ty = read_type_suffix(ty);
 
-  VarList *vl = calloc(1, sizeof(VarList));
+  VarList *vl = arena_alloc(sizeof(VarList));
   vl->var = new_lvar(name, ty);
   return vl;
 }
 
 /* 引数が0個ならNULLを返却、あれば変数ノード(VarList)を作成 */
 static VarList *read_func_params(void) {
-  if (consume(")")) return NULL;
+  if (consume_id(TK_RPAREN)) return NULL;
 
   VarList *head = read_func_param();
 
   VarList *cur = head;
 
-  while (!consume(")")) {
-    expect(",");
+  while (!consume_id(TK_RPAREN)) {
+    expect_id(TK_COMMA);
     cur->next = read_func_param();
     cur = cur->next;
   }
@@ -255,74 +382,90 @@ static VarList *read_func_params(void) {
 // function = basetype ident "(" params? ")" "{" stmt* "}"
 // params   = param ("," param)*
 // param    = basetype ident
-static Function *function(void) {
+// "("までは呼び出し元(toplevel)で読み終えている
+static Function *function(char *name) {
   locals = NULL;
 
-  Function *fn = calloc(1, sizeof(Function));
-  basetype();
-  fn->name = expect_ident();
-  expect("(");
+  Function *fn = arena_alloc(sizeof(Function));
+  fn->name = name;
 
-  VarList *sc = scope;
+  int sc = enter_scope();
   fn->params = read_func_params();
-  expect("{");
-
-  Node head = {};
-  Node *cur = &head;
+  expect_id(TK_LBRACE);
 
-  while (!consume("}")) {
-    cur->next = stmt();
-    cur = cur->next;
+  NodeId *cur = &fn->node;
+  while (!consume_id(TK_RBRACE)) {
+    *cur = stmt();
+    cur = &node_at(*cur)->next;
   }
-  scope = sc;
+  leave_scope(sc);
 
-  fn->node = head.next;
   fn->locals = locals;
   return fn;
 }
 
 // global-var = basetype ident ("[" num "]")* ";"
-static void global_var(void) {
-  Type *ty = basetype();
-  char *name = expect_ident();
+// identまでは呼び出し元(toplevel)で読み終えている
+static void global_var(Type *ty, char *name) {
   ty = read_type_suffix(ty);
-  expect(";");
-  new_gvar(name, ty);
+  expect_id(TK_SEMI);
+  new_gvar(name, ty, true);
 }
 
 // 変数宣言
 // declaration = basetype ident ("[" num "]")* ("=" expr) ";"
-static Node *declaration(void) {
-  Token *tok = token;
+static NodeId declaration(void) {
+  Token tok = token;
   Type *ty = basetype();
   char *name = expect_ident();
   ty = read_type_suffix(ty);
   Var *var = new_lvar(name, ty);
 
-  if (consume(";")) return new_node(ND_NULL, tok);
+  if (consume_id(TK_SEMI)) return new_node(ND_NULL, tok);
 
-  expect("=");
-  Node *lhs = new_var_node(var, tok);
-  Node *rhs = expr();
-  expect(";");
-  Node *node = new_binary(ND_ASSIGN, lhs, rhs, tok);
+  expect_id(TK_ASSIGN);
+  NodeId lhs = new_var_node(var, tok);
+  NodeId rhs = expr();
+  expect_id(TK_SEMI);
+  NodeId node = new_binary(ND_ASSIGN, lhs, rhs, tok);
   return new_unary(ND_EXPR_STMT, node, tok);
 }
 
-static Node *read_expr_stmt(void) {
-  Token *tok = token;
+static NodeId read_expr_stmt(void) {
+  Token tok = token;
   return new_unary(ND_EXPR_STMT, expr(), tok);
 }
 
 // 次のトークンが型を表す場合は、trueを返します。
 static bool is_typename(void) {
-  return peek("char") || peek("int") || peek("struct");
+  return peek_id(TK_CHAR) || peek_id(TK_SHORT) || peek_id(TK_INT) ||
+         peek_id(TK_LONG) || peek_id(TK_STRUCT);
 }
 
-/* 渡されたノードに型ノードを追加する処理を挟む */
-static Node *stmt(void) {
-  Node *node = stmt2();
+/*
+  渡されたノードに型ノードを追加する処理を挟む
+  文の中で構文エラーがあった場合は、その文を読み飛ばして空文を返す
+ */
+static NodeId stmt(void) {
+  Token tok = token;
+  jmp_buf *prev = error_recovery;
+  volatile bool parsed = false;
+  jmp_buf buf;
+
+  if (setjmp(buf)) {
+    error_recovery = prev;
+    if (!parsed) synchronize();
+
+    // これ以上読むものがない
+    if (at_eof()) exit(1);
+    return new_node(ND_NULL, tok);
+  }
+
+  error_recovery = &buf;
+  NodeId node = stmt2();
+  parsed = true;
   add_type(node);
+  error_recovery = prev;
   return node;
 }
 
@@ -336,75 +479,77 @@ static Node *stmt(void) {
               | declaration
               | expr ";"
  */
-static Node *stmt2(void) {
-  Token *tok;
-  if (tok = consume("return")) {
-    Node *node = new_unary(ND_RETURN, expr(), tok);
-    expect(";");
+static NodeId stmt2(void) {
+  Token tok;
+  if (tok = consume_id(TK_RETURN)) {
+    NodeId node = new_unary(ND_RETURN, expr(), tok);
+    expect_id(TK_SEMI);
     return node;
   }
 
-  if (tok = consume("if")) {
-    Node *node = new_node(ND_IF, tok);
-    expect("(");
+  // ノードの置き場所はかたまりごとに確保されるので、
+  // 子をパースしている間もnodeのアドレスは変わらない
+  if (tok = consume_id(TK_IF)) {
+    NodeId id = new_node(ND_IF, tok);
+    Node *node = node_at(id);
+    expect_id(TK_LPAREN);
     node->cond = expr();
-    expect(")");
+    expect_id(TK_RPAREN);
     node->then = stmt();
-    if (consume("else")) node->els = stmt();
-    return node;
+    if (consume_id(TK_ELSE)) node->els = stmt();
+    return id;
   }
 
-  if (tok = consume("while")) {
-    Node *node = new_node(ND_WHILE, tok);
-    expect("(");
+  if (tok = consume_id(TK_WHILE)) {
+    NodeId id = new_node(ND_WHILE, tok);
+    Node *node = node_at(id);
+    expect_id(TK_LPAREN);
     node->cond = expr();
-    expect(")");
+    expect_id(TK_RPAREN);
     node->then = stmt();
-    return node;
+    return id;
   }
 
-  if (tok = consume("for")) {
-    Node *node = new_node(ND_FOR, tok);
-    expect("(");
+  if (tok = consume_id(TK_FOR)) {
+    NodeId id = new_node(ND_FOR, tok);
+    Node *node = node_at(id);
+    expect_id(TK_LPAREN);
 
     // "for"初期値構文の始めに";"が来ていないかを確かめることで、
     // EBNFの"?"というオプショナルを実現している
-    if (!consume(";")) {  // "for"の初期値
+    if (!consume_id(TK_SEMI)) {  // "for"の初期値
       node->init = read_expr_stmt();
-      expect(";");
+      expect_id(TK_SEMI);
     }
-    if (!consume(";")) {  // "for"の条件部分
+    if (!consume_id(TK_SEMI)) {  // "for"の条件部分
       node->cond = expr();
-      expect(";");
+      expect_id(TK_SEMI);
     }
-    if (!consume(")")) {  // "for"の累積量部分
+    if (!consume_id(TK_RPAREN)) {  // "for"の累積量部分
       node->inc = read_expr_stmt();
-      expect(")");
+      expect_id(TK_RPAREN);
     }
     node->then = stmt();
-    return node;
+    return id;
   }
 
-  VarList *sc = scope;
-  if (tok = consume("{")) {
-    Node head = {};
-    Node *cur = &head;
+  int sc = enter_scope();
+  if (tok = consume_id(TK_LBRACE)) {
+    NodeId id = new_node(ND_BLOCK, tok);
+    NodeId *cur = &node_at(id)->body;
 
-    while (!consume("}")) {
-      cur->next = stmt();
-      cur = cur->next;
+    while (!consume_id(TK_RBRACE)) {
+      *cur = stmt();
+      cur = &node_at(*cur)->next;
     }
-    scope = sc;
-
-    Node *node = new_node(ND_BLOCK, tok);
-    node->body = head.next;
-    return node;
+    leave_scope(sc);
+    return id;
   }
 
   if (is_typename()) return declaration();
 
-  Node *node = read_expr_stmt();
-  expect(";");
+  NodeId node = read_expr_stmt();
+  expect_id(TK_SEMI);
   return node;
 }
 
@@ -412,120 +557,127 @@ static Node *stmt2(void) {
   assign演算子をパースする関数
   EBNF: expr = assign
  */
-static Node *expr(void) { return assign(); }
+static NodeId expr(void) { return assign(); }
 
 /*
   `=`演算子をパースする関数
-  EBNF: assign = equality ("=" assign)?
+  EBNF: assign = binary ("=" assign)?
+  右結合の連鎖(a = b = c ...)は再帰せず、右辺を埋める場所(hole)を辿って作る
  */
-static Node *assign(void) {
-  Node *node = equality();
-  Token *tok;
-  if (consume("=")) node = new_binary(ND_ASSIGN, node, assign(), tok);
-  return node;
-}
-
-/*
-  比較演算子の`==`と`!=`をパースする関数
-  EBNF: equality = relational ("==" relational | "!=" relational)*
- */
-static Node *equality(void) {
-  Node *node = relational();
-  Token *tok;
-
-  for (;;) {
-    if (tok = consume("=="))
-      node = new_binary(ND_EQ, node, relational(), tok);
-    else if (tok = consume("!="))
-      node = new_binary(ND_NE, node, relational(), tok);
-    else
-      return node;
-  }
-}
-
-/*
-  比較演算子の大なり小なりをパースする関数
-  EBNF: relational = add ("<" add | "<=" add | ">" add | ">=" add)*
- */
-static Node *relational(void) {
-  Node *node = add();
-  Token *tok;
-
-  for (;;) {
-    if (tok = consume("<"))
-      node = new_binary(ND_LT, node, add(), tok);
-    else if (tok = consume("<="))
-      node = new_binary(ND_LE, node, add(), tok);
-    else if (tok = consume(">"))
-      node = new_binary(ND_LT, add(), node, tok);
-    else if (tok = consume(">="))
-      node = new_binary(ND_LE, add(), node, tok);
-    else
-      return node;
+static NodeId assign(void) {
+  NodeId node = binary(1);
+  NodeId *hole = &node;
+  Token tok;
+
+  while (tok = consume_id(TK_ASSIGN)) {
+    NodeId rhs = binary(1);
+    *hole = new_binary(ND_ASSIGN, *hole, rhs, tok);
+    hole = &node_at(*hole)->rhs;
   }
+  return node;
 }
 
 /* 整数同士の足し算、ポインタの足し算ノードを作成する関数 */
-static Node *new_add(Node *lhs, Node *rhs, Token *tok) {
+static NodeId new_add(NodeId lhs, NodeId rhs, Token tok) {
   add_type(lhs);
   add_type(rhs);
+  Type *lty = node_at(lhs)->ty;
+  Type *rty = node_at(rhs)->ty;
 
-  if (is_integer(lhs->ty) && is_integer(rhs->ty))
+  if (is_integer(lty) && is_integer(rty))
     return new_binary(ND_ADD, lhs, rhs, tok);
-  if (lhs->ty->base && is_integer(rhs->ty))
+  if (lty->base && is_integer(rty))
     return new_binary(ND_PTR_ADD, lhs, rhs, tok);
-  if (is_integer(lhs->ty) && rhs->ty->base)
+  if (is_integer(lty) && rty->base)
     return new_binary(ND_PTR_ADD, rhs, lhs, tok);
   error_tok(tok, "invalid operands");
 }
 
 /* 整数同士の引き算、ポインタの引き算ノードを作成する関数 */
-static Node *new_sub(Node *lhs, Node *rhs, Token *tok) {
+static NodeId new_sub(NodeId lhs, NodeId rhs, Token tok) {
   add_type(lhs);
   add_type(rhs);
+  Type *lty = node_at(lhs)->ty;
+  Type *rty = node_at(rhs)->ty;
 
-  if (is_integer(lhs->ty) && is_integer(rhs->ty))
+  if (is_integer(lty) && is_integer(rty))
     return new_binary(ND_SUB, lhs, rhs, tok);
-  if (lhs->ty->base && is_integer(rhs->ty))
+  if (lty->base && is_integer(rty))
     return new_binary(ND_PTR_SUB, lhs, rhs, tok);
-  if (lhs->ty->base && rhs->ty->base)
+  if (lty->base && rty->base)
     return new_binary(ND_PTR_DIFF, lhs, rhs, tok);
   error_tok(tok, "invalid operands");
 }
 
-/*
-  加減演算子をパースする関数
-  EBNF: add = mul ("+" mul | "-" mul)*
- */
-static Node *add(void) {
-  Node *node = mul();
-  Token *tok;
+// 二項演算子の優先順位。大きいほど強く結合する。二項演算子でなければ0
+static int binop_prec(TokenKind kind) {
+  switch (kind) {
+    case TK_EQ:
+    case TK_NE:
+      return 1;
+    case TK_LT:
+    case TK_LE:
+    case TK_GT:
+    case TK_GE:
+      return 2;
+    case TK_PLUS:
+    case TK_MINUS:
+      return 3;
+    case TK_STAR:
+    case TK_SLASH:
+      return 4;
+    default:
+      return 0;
+  }
+}
 
-  for (;;) {
-    if (tok = consume("+"))
-      node = new_add(node, mul(), tok);
-    else if (tok = consume("-"))
-      node = new_sub(node, mul(), tok);
-    else
-      return node;
+// 二項演算子`op`のノードを作る
+static NodeId new_binop(TokenKind op, NodeId lhs, NodeId rhs, Token tok) {
+  switch (op) {
+    case TK_EQ:
+      return new_binary(ND_EQ, lhs, rhs, tok);
+    case TK_NE:
+      return new_binary(ND_NE, lhs, rhs, tok);
+    case TK_LT:
+      return new_binary(ND_LT, lhs, rhs, tok);
+    case TK_LE:
+      return new_binary(ND_LE, lhs, rhs, tok);
+    case TK_GT:  // a > b を b < a に置換
+      return new_binary(ND_LT, rhs, lhs, tok);
+    case TK_GE:
+      return new_binary(ND_LE, rhs, lhs, tok);
+    case TK_PLUS:
+      return new_add(lhs, rhs, tok);
+    case TK_MINUS:
+      return new_sub(lhs, rhs, tok);
+    case TK_STAR:
+      return new_binary(ND_MUL, lhs, rhs, tok);
+    default:
+      return new_binary(ND_DIV, lhs, rhs, tok);
   }
 }
 
 /*
-  乗除演算子をパースする関数
-  EBNF: mul = unary ("*" unary | "/" unary)*
+  二項演算子を、優先順位に従ってパースする関数(precedence climbing)
+  EBNF: equality   = relational ("==" relational | "!=" relational)*
+        relational = add ("<" add | "<=" add | ">" add | ">=" add)*
+        add        = mul ("+" mul | "-" mul)*
+        mul        = unary ("*" unary | "/" unary)*
+  優先順位が`min_prec`以上の演算子だけを読む。同じ優先順位の演算子の連鎖は
+  ループで左結合に組み立てるので、再帰の深さは優先順位の段数までで済む
  */
-static Node *mul(void) {
-  Node *node = unary();
-  Token *tok;
+static NodeId binary(int min_prec) {
+  NodeId node = unary();
 
   for (;;) {
-    if (tok = consume("*"))
-      node = new_binary(ND_MUL, node, unary(), tok);
-    else if (tok = consume("/"))
-      node = new_binary(ND_DIV, node, unary(), tok);
-    else
-      return node;
+    TokenKind op = tok_kind(token);
+    int prec = binop_prec(op);
+    if (!prec || prec < min_prec) return node;
+
+    Token tok = token;
+    next_token();
+    NodeId rhs = binary(prec + 1);
+    node = new_binop(op, node, rhs, tok);
   }
 }
 
@@ -533,56 +685,64 @@ static Node *mul(void) {
   単項演算子をパースする関数
   EBNF: unary   = ("+" | "-" | "*" | "&")? unary　
                 | postfix
+  前置演算子の連鎖は再帰せず、被演算子を埋める場所(hole)を辿って作る
 */
-static Node *unary(void) {
-  Token *tok;
-  if (consume("+")) return unary();  // +xをxに置換
+static NodeId unary(void) {
+  NodeId node;
+  NodeId *hole = &node;
+  Token tok;
 
-  if (tok = consume("-"))  // -xを0 - xに置換
-    return new_binary(ND_SUB, new_num(0, tok), unary(), tok);
-
-  if (tok = consume("&"))  // -アドレスを取り出す
-    return new_unary(ND_ADDR, unary(), tok);
-
-  if (tok = consume("*"))  // ポインタまたはアドレスから値を取り出す
-    return new_unary(ND_DEREF, unary(), tok);
-  return postfix();
-}
+  for (;;) {
+    if (consume_id(TK_PLUS)) continue;  // +xをxに置換
+
+    if (tok = consume_id(TK_MINUS)) {  // -xを0 - xに置換
+      *hole = new_binary(ND_SUB, new_num(0, tok), 0, tok);
+      hole = &node_at(*hole)->rhs;
+    } else if (tok = consume_id(TK_AMP)) {  // -アドレスを取り出す
+      *hole = new_unary(ND_ADDR, 0, tok);
+      hole = &node_at(*hole)->lhs;
+    } else if (tok = consume_id(TK_STAR)) {
+      // ポインタまたはアドレスから値を取り出す
+      *hole = new_unary(ND_DEREF, 0, tok);
+      hole = &node_at(*hole)->lhs;
+    } else {
+      break;
+    }
+  }
 
-static Member *find_member(Type *ty, char *name) {
-  for (Member *mem = ty->members; mem; mem = mem->next)
-    if (!strcmp(mem->name, name)) return mem;
-  return NULL;
+  *hole = postfix();
+  return node;
 }
 
-static Node *struct_ref(Node *lhs) {
+static NodeId struct_ref(NodeId lhs) {
   add_type(lhs);
-  if (lhs->ty->kind != TY_STRUCT) error_tok(lhs->tok, "not a struct");
+  Node *l = node_at(lhs);
+  if (l->ty->kind != TY_STRUCT) error_tok(l->tok, "not a struct");
 
-  Token *tok = token;
-  Member *mem = find_member(lhs->ty, expect_ident());
+  Token tok = token;
+  Member *mem = find_member(l->ty, expect_ident());
   if (!mem) error_tok(tok, "no such member");
 
-  Node *node = new_unary(ND_MEMBER, lhs, tok);
-  node->member = mem;
+  NodeId node = new_unary(ND_MEMBER, lhs, tok);
+  node_at(node)->member = mem;
   return node;
 }
 
 // postfix = primary ("[" expr "]" | "." ident)*
-static Node *postfix(void) {
-  Node *node = primary();
-  Token *tok;
+static NodeId postfix(void) {
+  NodeId node = primary();
+  Token tok;
 
   for (;;) {
-    if (tok = consume("[")) {
+    if (tok = consume_id(TK_LBRACKET)) {
       // x[y] is short for *(x+y)
-      Node *exp = new_add(node, expr(), tok);
-      expect("]");
+      NodeId exp = new_add(node, expr(), tok);
+      expect_id(TK_RBRACKET);
       node = new_unary(ND_DEREF, exp, tok);
       continue;
     }
 
-    if (tok = consume(".")) {
+    if (tok = consume_id(TK_DOT)) {
       node = struct_ref(node);
       continue;
     }
@@ -594,20 +754,20 @@ static Node *postfix(void) {
 // stmt-expr = "(" "{" stmt stmt* "}" ")"
 //
 // ステートメント式は、GNU Cの拡張機能です。
-static Node *stmt_expr(Token *tok) {
-  Node *node = new_node(ND_STMT_EXPR, tok);
-  node->body = stmt();
-  Node *cur = node->body;
+static NodeId stmt_expr(Token tok) {
+  NodeId node = new_node(ND_STMT_EXPR, tok);
+  NodeId last = node_at(node)->body = stmt();
 
-  while (!consume("}")) {
-    cur->next = stmt();
-    cur = cur->next;
+  while (!consume_id(TK_RBRACE)) {
+    node_at(last)->next = stmt();
+    last = node_at(last)->next;
   }
-  expect(")");
+  expect_id(TK_RPAREN);
 
+  Node *cur = node_at(last);
   if (cur->kind != ND_EXPR_STMT)
     error_tok(cur->tok, "stmt expr returning void is not supported");
-  memcpy(cur, cur->lhs, sizeof(Node));
+  *cur = *node_at(cur->lhs);
   return node;
 }
 
@@ -615,16 +775,16 @@ static Node *stmt_expr(Token *tok) {
   引数の有無に応じて処理が分岐し、パースする関数
   EBNF: func-args = "(" (assign ("," assign)*)? ")"
 */
-static Node *func_args(void) {
-  if (consume(")")) return NULL;
-
-  Node *head = assign();
-  Node *cur = head;
-  while (consume(",")) {
-    cur->next = assign();
-    cur = cur->next;
+static NodeId func_args(void) {
+  if (consume_id(TK_RPAREN)) return 0;
+
+  NodeId head = assign();
+  NodeId cur = head;
+  while (consume_id(TK_COMMA)) {
+    node_at(cur)->next = assign();
+    cur = node_at(cur)->next;
   }
-  expect(")");
+  expect_id(TK_RPAREN);
   return head;
 }
 
@@ -637,31 +797,31 @@ static Node *func_args(void) {
                 | str
                 | num
  */
-static Node *primary(void) {
-  Token *tok;
+static NodeId primary(void) {
+  Token tok;
 
   // 次のトークンが"("なら、"(" expr ")"のはず
-  if (consume("(")) {
-    if (consume("{")) return stmt_expr(tok);
+  if (tok = consume_id(TK_LPAREN)) {
+    if (consume_id(TK_LBRACE)) return stmt_expr(tok);
 
-    Node *node = expr();
-    expect(")");
+    NodeId node = expr();
+    expect_id(TK_RPAREN);
     return node;
   }
 
-  if (tok = consume("sizeof")) {
-    Node *node = unary();
+  if (tok = consume_id(TK_SIZEOF)) {
+    NodeId node = unary();
     add_type(node);
-    return new_num(node->ty->size, tok);
+    return new_num(node_at(node)->ty->size, tok);
   }
 
   if (tok = consume_ident()) {
     // 識別子の次に"()"がきたら Function
-    if (consume("(")) {
-      Node *node = new_node(ND_FUNCALL, tok);
-      // strndupは第2引数のサイズ指定分、文字列を複製する
-      node->funcname = strndup(tok->str, tok->len);
-      node->args = func_args();  // 引数ノードの作成は`func_args`に任せる
+    if (consume_id(TK_LPAREN)) {
+      NodeId node = new_node(ND_FUNCALL, tok);
+      node_at(node)->funcname = tok_ident(tok);
+      // 引数ノードの作成は`func_args`に任せる
+      node_at(node)->args = func_args();
       return node;
     }
 
@@ -673,17 +833,18 @@ static Node *primary(void) {
   }
 
   tok = token;
-  if (tok->kind == TK_STR) {
-    token = token->next;
-
-    Type *ty = array_of(char_type, tok->cont_len);
-    Var *var = new_gvar(new_label(), ty);
-    var->contents = tok->contents;
-    var->cont_len = tok->cont_len;
+  if (tok_kind(tok) == TK_STR) {
+    StrLit *str = tok_strlit(tok);
+    next_token();
+
+    Type *ty = array_of(char_type, str->cont_len);
+    Var *var = new_gvar(new_label(), ty, false);
+    var->contents = str->contents;
+    var->cont_len = str->cont_len;
     return new_var_node(var, tok);
   }
 
-  if (tok->kind != TK_NUM) error_tok(tok, "expected expression");
+  if (tok_kind(tok) != TK_NUM) error_tok(tok, "expected expression");
   // そうでなければ数値のはず
   return new_num(expect_number(), tok);
 }
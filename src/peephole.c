@@ -0,0 +1,508 @@
+#include "./9cc.h"
+
+//
+// 注釈：
+// 覗き穴最適化。codegen.cが作った関数1つ分の命令の列を、隣り合う数命令を
+// 見ながら書き換える
+// ・自分自身へのmov、0の加減算、結果を使わないmov/lea/movsx/movzbを消す
+// ・movで写したレジスタ・即値・メモリを次の命令のオペランドに直接書き、
+//   leaで求めたアドレスを次の命令のアドレス指定に含め、movやleaを消す
+//   (即値やアドレス指定の大部分は、ir.cの命令選択で既に使っている)
+// ・スタックに書いた値をすぐに読み出すmovを、レジスタ間のmovにする
+// ・setcc, movzb, cmp 0, je/jneの並びを、1つの条件分岐にする
+// ・次の命令へのjmp、jmpを飛び越えるだけの条件分岐、到達しない命令を消す
+// 書き換えたレジスタの値が後で使われないかは、命令の列の上で生存解析をして調べる
+// 何も書き換えられなくなるまで繰り返す
+//
+
+#define BIT(reg) (1u << (reg))
+
+// 関数の引数のレジスタ、関数呼び出しで壊れるレジスタ、呼び出し元に返すレジスタ
+#define ARG_REGS(n) (BIT(n) - 1)
+#define CALLER_SAVED \
+  (ARG_REGS(6) | BIT(REG_R10) | BIT(REG_R11) | BIT(REG_RAX))
+#define CALLEE_SAVED                                                \
+  (BIT(REG_RBX) | BIT(REG_R12) | BIT(REG_R13) | BIT(REG_R14) | \
+   BIT(REG_R15) | BIT(REG_RBP) | BIT(REG_RSP))
+
+static long num_insns;    // peepholeに渡された命令の数(ラベルを除く)
+static long num_removed;  // そのうち消した数
+
+static Insn *insns;
+static int len;
+static unsigned *live_out;  // 命令の直後で生きているレジスタ
+static unsigned *live_in;   // 命令の直前で生きているレジスタ
+static int *label_pos;      // ラベルの番号からその位置を引く表
+static int *label_refs;     // ラベルに飛ぶ命令の数
+static int label_min;
+static int live_cap;
+static int label_cap;
+static bool changed;
+
+// 命令を消す
+static void nop(Insn *insn) {
+  if (insn->op != M_LABEL) num_removed++;
+  insn->op = M_NOP;
+  changed = true;
+}
+
+// 消した命令を飛ばして、`i`より後の命令の位置を返す
+static int next_insn(int i) {
+  for (i++; i < len; i++)
+    if (insns[i].op != M_NOP) return i;
+  return len;
+}
+
+// オペランドを求めるのに読むレジスタ
+static unsigned opd_regs(Operand *opd) {
+  if (opd->kind == OPD_REG) return BIT(opd->reg);
+  if (opd->kind != OPD_MEM) return 0;
+
+  unsigned regs = 0;
+  if (opd->reg != REG_NONE) regs |= BIT(opd->reg);
+  if (opd->index != REG_NONE) regs |= BIT(opd->index);
+  return regs;
+}
+
+// オペランドにレジスタ`reg`が現れる回数(ベースと添字は別に数える)
+static int count_reg(Operand *opd, int reg) {
+  if (opd->kind == OPD_REG) return opd->reg == reg;
+  if (opd->kind != OPD_MEM) return 0;
+  return (opd->reg == reg) + (opd->index == reg);
+}
+
+// dstに書き込むだけで、読まない命令か
+static bool writes_dst_only(Insn *insn) {
+  switch (insn->op) {
+    case M_MOV:
+    case M_MOVSX:
+    case M_MOVZB:
+    case M_LEA:
+    case M_POP:
+      return true;
+  }
+  return false;
+}
+
+// 命令が読むレジスタ
+static unsigned uses(Insn *insn) {
+  unsigned dst = insn->dst.kind == OPD_MEM || !writes_dst_only(insn)
+                     ? opd_regs(&insn->dst)
+                     : 0;
+  unsigned src = opd_regs(&insn->src);
+  switch (insn->op) {
+    case M_NOP:
+    case M_LABEL:
+    case M_JMP:
+    case M_JCC:
+    case M_SET:
+      return 0;
+    case M_CQO:
+      return BIT(REG_RAX);
+    case M_IDIV:
+      return BIT(REG_RAX) | BIT(REG_RDX) | src;
+    case M_CALL:
+      // RAXにはベクトルレジスタの引数の数が入っている
+      return ARG_REGS(insn->nargs) | BIT(REG_RAX);
+    case M_PUSH:
+    case M_POP:
+      return BIT(REG_RSP) | src;
+    case M_RET:
+      return BIT(REG_RAX) | CALLEE_SAVED;
+  }
+  return dst | src;
+}
+
+// 命令が書き込むレジスタ
+static unsigned defs(Insn *insn) {
+  switch (insn->op) {
+    case M_MOV:
+    case M_MOVSX:
+    case M_MOVZB:
+    case M_LEA:
+    case M_ADD:
+    case M_SUB:
+    case M_IMUL:
+      return insn->dst.kind == OPD_REG ? BIT(insn->dst.reg) : 0;
+    case M_CQO:
+      return BIT(REG_RDX);
+    case M_IDIV:
+      return BIT(REG_RAX) | BIT(REG_RDX);
+    case M_SET:
+      return BIT(REG_RAX);
+    case M_CALL:
+      return CALLER_SAVED;
+    case M_PUSH:
+      return BIT(REG_RSP);
+    case M_POP:
+      return BIT(REG_RSP) | BIT(insn->dst.reg);
+  }
+  return 0;
+}
+
+// ラベルの番号からlabel_pos, label_refsの添字を求める
+// 関数の終わりのラベル(0)は先頭に置き、残りは関数の中の最小の番号から並べる
+static int slot(int label) { return label ? label - label_min + 1 : 0; }
+
+// ラベルの位置と、そこに飛ぶ命令の数を数える
+static void find_labels(void) {
+  int lo = INT_MAX;
+  int hi = 0;
+  for (int i = 0; i < len; i++) {
+    int label = insns[i].label;
+    if (insns[i].op != M_LABEL || !label) continue;
+    if (label < lo) lo = label;
+    if (hi < label) hi = label;
+  }
+  label_min = lo;
+
+  int n = lo <= hi ? hi - lo + 2 : 1;
+  if (label_cap < n) {
+    label_cap = n;
+    label_pos = realloc(label_pos, n * sizeof(int));
+    label_refs = realloc(label_refs, n * sizeof(int));
+  }
+  memset(label_refs, 0, n * sizeof(int));
+
+  for (int i = 0; i < len; i++) {
+    Insn *insn = &insns[i];
+    if (insn->op == M_LABEL) label_pos[slot(insn->label)] = i;
+    if (insn->op == M_JMP || insn->op == M_JCC)
+      label_refs[slot(insn->label)]++;
+  }
+}
+
+/*
+  命令ごとに、直前と直後で生きている(後で値が読まれる)レジスタを求める
+  live_out = 次に実行しうる命令のlive_inの和
+  live_in  = (live_out - 書き込むレジスタ) + 読むレジスタ
+  変化がなくなるまで、後ろの命令から繰り返し計算する
+ */
+static void analyze_liveness(void) {
+  if (live_cap < len) {
+    live_cap = len;
+    live_in = realloc(live_in, len * sizeof(unsigned));
+    live_out = realloc(live_out, len * sizeof(unsigned));
+  }
+  memset(live_in, 0, len * sizeof(unsigned));
+
+  for (bool again = true; again;) {
+    again = false;
+    for (int i = len - 1; i >= 0; i--) {
+      Insn *insn = &insns[i];
+      unsigned out = 0;
+      if (insn->op == M_JMP || insn->op == M_JCC)
+        out = live_in[label_pos[slot(insn->label)]];
+      if (insn->op != M_JMP && insn->op != M_RET && i + 1 < len)
+        out |= live_in[i + 1];
+
+      unsigned in = uses(insn) | (out & ~defs(insn));
+      if (in != live_in[i]) again = true;
+      live_in[i] = in;
+      live_out[i] = out;
+    }
+  }
+}
+
+// 命令`insn`が、明示したオペランド以外でレジスタ`reg`を読むか
+static bool reads_implicitly(Insn *insn, int reg) {
+  unsigned explicit = opd_regs(&insn->dst) | opd_regs(&insn->src);
+  return uses(insn) & ~explicit & BIT(reg);
+}
+
+// 命令`insn`のオペランドがレジスタ`reg`を読む回数
+static int count_reads(Insn *insn, int reg) {
+  int n = count_reg(&insn->src, reg);
+  if (insn->dst.kind == OPD_MEM || !writes_dst_only(insn))
+    n += count_reg(&insn->dst, reg);
+  return n;
+}
+
+// `i`番目の命令の後で、レジスタ`reg`の(その時点の)値が使われないか
+static bool dead_after(int i, int reg) {
+  return !(live_out[i] & BIT(reg)) || (defs(&insns[i]) & BIT(reg));
+}
+
+static bool is_reg(Operand *opd, int reg) {
+  return opd->kind == OPD_REG && opd->reg == reg;
+}
+
+static bool fits_int32(long val) { return val == (int)val; }
+
+// 値をsizeバイトに切り詰めて符号拡張する
+static long truncate_to(long val, int size) {
+  if (size == 1) return (signed char)val;
+  if (size == 2) return (short)val;
+  if (size == 4) return (int)val;
+  return val;
+}
+
+/*
+  `mov reg, x`の直後の命令`y`がregを1回だけ読み、その後regの値を使わないなら、
+  yのオペランドをxに置き換える。置き換えられたらtrueを返す
+ */
+static bool forward_mov(Insn *x, Insn *y) {
+  int reg = x->dst.reg;
+  Operand *val = &x->src;
+  if (count_reads(y, reg) != 1 || reads_implicitly(y, reg)) return false;
+
+  // yのsrcとして読む場合
+  if (is_reg(&y->src, reg)) {
+    Operand *src = &y->src;
+    switch (y->op) {
+      case M_MOV:
+      case M_ADD:
+      case M_SUB:
+      case M_IMUL:
+      case M_CMP:
+        if (val->kind == OPD_REG) {
+          src->reg = val->reg;
+          return true;
+        }
+        if (val->kind == OPD_IMM) {
+          long v = truncate_to(val->val, src->size);
+          bool mov_to_reg = y->op == M_MOV && y->dst.kind == OPD_REG;
+          if (!mov_to_reg && !fits_int32(v)) return false;
+          *src = (Operand){.kind = OPD_IMM, .val = v};
+          return true;
+        }
+        // メモリからメモリへの命令はない
+        if (val->kind == OPD_MEM && src->size == 8 && y->dst.kind == OPD_REG) {
+          *src = *val;
+          return true;
+        }
+        // アドレスは32ビットに収まる(静的リンク)
+        if (val->kind == OPD_SYM && y->op == M_MOV && y->dst.kind == OPD_REG) {
+          *src = *val;
+          return true;
+        }
+        return false;
+      case M_MOVSX:
+        if (val->kind == OPD_REG) {
+          src->reg = val->reg;
+          return true;
+        }
+        // リトルエンディアンなので、下位バイトは同じアドレスから読める
+        if (val->kind == OPD_MEM) {
+          int size = src->size;
+          *src = *val;
+          src->size = size;
+          return true;
+        }
+        if (val->kind == OPD_IMM) {
+          y->op = M_MOV;
+          long v = truncate_to(val->val, src->size);
+          *src = (Operand){.kind = OPD_IMM, .val = v};
+          return true;
+        }
+        return false;
+    }
+    return false;
+  }
+
+  // cmpの左辺として読む場合
+  if (y->op == M_CMP && is_reg(&y->dst, reg)) {
+    if (val->kind == OPD_REG) {
+      y->dst.reg = val->reg;
+      return true;
+    }
+    if (val->kind == OPD_MEM && y->src.kind != OPD_MEM) {
+      y->dst = *val;
+      return true;
+    }
+    return false;
+  }
+
+  // アドレスのベースか添字として読む場合
+  if (val->kind != OPD_REG) return false;
+  Operand *opd = y->dst.kind == OPD_MEM ? &y->dst : &y->src;
+  if (opd->kind != OPD_MEM || !count_reg(opd, reg)) return false;
+  if (opd->reg == reg)
+    opd->reg = val->reg;
+  else
+    opd->index = val->reg;
+  return true;
+}
+
+/*
+  `lea reg, addr`の直後の命令`y`が、regをベースにしたアドレスで
+  1回だけ読み、その後regの値を使わないなら、addrをyのアドレスに含める
+ */
+static bool fold_lea(Insn *x, Insn *y) {
+  int reg = x->dst.reg;
+  if (count_reads(y, reg) != 1 || reads_implicitly(y, reg)) return false;
+
+  Operand *opd;
+  if (y->dst.kind == OPD_MEM && y->dst.reg == reg)
+    opd = &y->dst;
+  else if (y->src.kind == OPD_MEM && y->src.reg == reg)
+    opd = &y->src;
+  else
+    return false;
+
+  // 添字とシンボルは1つずつしか書けない
+  Operand *addr = &x->src;
+  if (addr->index != REG_NONE && opd->index != REG_NONE) return false;
+  if (addr->sym && opd->sym) return false;
+  if (!fits_int32(opd->val + addr->val)) return false;
+
+  opd->reg = addr->reg;
+  if (addr->index != REG_NONE) {
+    opd->index = addr->index;
+    opd->scale = addr->scale;
+  }
+  if (addr->sym) opd->sym = addr->sym;
+  opd->val += addr->val;
+  return true;
+}
+
+static bool same_mem(Operand *a, Operand *b) {
+  return a->kind == OPD_MEM && b->kind == OPD_MEM && a->reg == b->reg &&
+         a->index == b->index && a->scale == b->scale && a->sym == b->sym &&
+         a->val == b->val && a->size == b->size;
+}
+
+// `i`番目から続くラベルの中に`label`があるか
+static bool label_follows(int i, int label) {
+  for (; i < len && (insns[i].op == M_LABEL || insns[i].op == M_NOP); i++)
+    if (insns[i].op == M_LABEL && insns[i].label == label) return true;
+  return false;
+}
+
+// `i`番目の命令から始まる並びを書き換える
+static void rewrite(int i) {
+  Insn *x = &insns[i];
+  int j = next_insn(i);
+  Insn *y = j < len ? &insns[j] : NULL;
+
+  switch (x->op) {
+    case M_LABEL:
+      // 飛んでくる命令がなく、直前の命令からも来ないラベルは消してよい
+      // (直前から来る場合でも、ラベルがなければそのまま進むだけ)
+      if (x->label && !label_refs[slot(x->label)]) nop(x);
+      return;
+    case M_MOV:
+      if (x->dst.kind == OPD_REG && is_reg(&x->src, x->dst.reg) &&
+          x->src.size == 8) {
+        nop(x);
+        return;
+      }
+      // スタックに書いた値をすぐに読み出すなら、書いたレジスタから写す
+      if (x->src.kind == OPD_REG && x->src.size == 8 && y &&
+          y->op == M_MOV && y->dst.kind == OPD_REG &&
+          same_mem(&x->dst, &y->src) && x->dst.size == 8) {
+        y->src = x->src;
+        changed = true;
+        return;
+      }
+      break;
+    case M_ADD:
+    case M_SUB:
+      // 演算の結果のフラグは使っていない
+      if (x->src.kind == OPD_IMM && x->src.val == 0) nop(x);
+      return;
+    case M_SET: {
+      // setcc al; movzb r, al; cmp r, 0; je/jne L
+      if (!y || y->op != M_MOVZB) return;
+      int k = next_insn(j);
+      if (k == len) return;
+      Insn *z = &insns[k];
+      int l = next_insn(k);
+      if (l == len) return;
+      Insn *w = &insns[l];
+
+      int r = y->dst.reg;
+      if (z->op != M_CMP || !is_reg(&z->dst, r) || z->src.kind != OPD_IMM ||
+          z->src.val != 0 || w->op != M_JCC ||
+          (w->cc != CC_E && w->cc != CC_NE) ||
+          (live_out[l] & (BIT(r) | BIT(REG_RAX))))
+        return;
+
+      // 0と等しければ条件は偽
+      w->cc = w->cc == CC_E ? x->cc ^ 1 : x->cc;
+      nop(x);
+      nop(y);
+      nop(z);
+      return;
+    }
+    case M_JCC:
+      // jcc L1; jmp L2; L1: -> j(逆の条件) L2; L1:
+      if (y && y->op == M_JMP && label_follows(next_insn(j), x->label)) {
+        label_refs[slot(x->label)]--;
+        x->cc ^= 1;
+        x->label = y->label;
+        nop(y);
+      }
+      return;
+    case M_JMP:
+      if (label_follows(i + 1, x->label)) {
+        label_refs[slot(x->label)]--;
+        nop(x);
+        return;
+      }
+      // fallthrough
+    case M_RET:
+      // 次のラベルまでは到達しない
+      for (int k = i + 1; k < len && insns[k].op != M_LABEL; k++) {
+        if (insns[k].op == M_NOP) continue;
+        if (insns[k].op == M_JMP || insns[k].op == M_JCC)
+          label_refs[slot(insns[k].label)]--;
+        nop(&insns[k]);
+      }
+      return;
+    case M_LEA:
+    case M_MOVSX:
+    case M_MOVZB:
+      break;
+    default:
+      return;
+  }
+
+  // 書き込んだレジスタの値を使わないなら、命令ごと消す
+  if (x->dst.kind != OPD_REG || x->dst.reg == REG_RSP ||
+      x->dst.reg == REG_RBP)
+    return;
+  if (!(live_out[i] & BIT(x->dst.reg))) {
+    nop(x);
+    return;
+  }
+
+  // 次の命令だけが使うなら、次の命令に直接書く
+  if (!y || !dead_after(j, x->dst.reg)) return;
+  if (x->op == M_MOV && x->dst.size == 8 && forward_mov(x, y)) {
+    nop(x);
+    return;
+  }
+  if (x->op == M_LEA && fold_lea(x, y)) nop(x);
+}
+
+// 消した命令を詰める
+static void compact(void) {
+  int n = 0;
+  for (int i = 0; i < len; i++)
+    if (insns[i].op != M_NOP) insns[n++] = insns[i];
+  len = n;
+}
+
+// 関数1つ分の命令の列`v`(長さ`n`)を書き換え、書き換えた後の長さを返す
+int peephole(Insn *v, int n) {
+  insns = v;
+  len = n;
+  for (int i = 0; i < len; i++) num_insns += insns[i].op != M_LABEL;
+
+  do {
+    changed = false;
+    find_labels();
+    analyze_liveness();
+    for (int i = 0; i < len; i++)
+      if (insns[i].op != M_NOP) rewrite(i);
+    compact();
+  } while (changed);
+  return len;
+}
+
+// 消した命令の数を標準エラー出力に書く(--peephole-stats)
+void print_peephole_stats(void) {
+  fprintf(stderr, "peephole: removed %ld of %ld instructions\n", num_removed,
+          num_insns);
+}
@@ -0,0 +1,315 @@
+#include "./9cc.h"
+
+//
+// 注釈：
+// 中間表現の仮想レジスタを物理レジスタに割り当てる(線形走査法)
+// 1. 命令に実行順の通し番号(位置)を付ける
+// 2. ブロックをまたいで使う仮想レジスタについて生存解析(データフロー解析)を
+//    行い、各ブロックの入口と出口で生きているものを求める
+// 3. 仮想レジスタごとに、定義・使用の位置と生きているブロックを覆う区間を作る
+// 4. 区間の始まりの順にレジスタを割り当てる。関数呼び出しをまたぐ区間は
+//    callee-savedのレジスタにしか置けない。空きがなければ、区間の終わりが
+//    最も遠いものをスタックに置く(spill)
+// 最後にフレームの配置(退避したレジスタ、メモリに置く変数、spill)を決める
+//
+
+// 割り当てに使うレジスタ。caller-savedを先に使う
+static Reg caller_saved[] = {REG_RDI, REG_RSI, REG_RCX, REG_R8, REG_R9};
+static Reg callee_saved[] = {REG_RBX, REG_R12, REG_R13, REG_R14, REG_R15};
+#define NUM_CALLER_SAVED 5
+#define NUM_CALLEE_SAVED 5
+#define NUM_ALLOC_REGS (REG_R15 + 1)
+
+static Function *fn;
+static int *start;  // 仮想レジスタの区間の始まり(使われなければINT_MAX)
+static int *end;    // 区間の終わり
+
+/*
+  命令`ir`が使う仮想レジスタを`regs`に入れ、その数を返す
+  定義する仮想レジスタ(あれば)は*defに入れる
+ */
+static int ir_regs(IR *ir, int *regs, int *def) {
+  *def = 0;
+  int n = 0;
+  switch (ir->op) {
+    case IR_IMM:
+      *def = ir->d;
+      return 0;
+    case IR_MOV:
+    case IR_SEXT:
+      *def = ir->d;
+      regs[0] = ir->a;
+      return 1;
+    case IR_LEA:
+    case IR_LOAD:
+    case IR_STORE:
+      // アドレスのベース(変数が基点ならない)と添字
+      if (ir->op == IR_STORE)
+        regs[n++] = ir->b;
+      else
+        *def = ir->d;
+      if (!ir->var) regs[n++] = ir->a;
+      if (ir->index) regs[n++] = ir->index;
+      return n;
+    case IR_CALL:
+      *def = ir->d;
+      for (int i = 0; i < ir->nargs; i++) regs[i] = ir->args[i];
+      return ir->nargs;
+    case IR_RET:
+    case IR_BR:
+      regs[0] = ir->a;
+      return 1;
+    case IR_JMP:
+      return 0;
+  }
+  // 二項演算。bが0なら右辺は即値
+  *def = ir->d;
+  regs[n++] = ir->a;
+  if (ir->b) regs[n++] = ir->b;
+  return n;
+}
+
+// 仮想レジスタ`r`を`pos`で使う(または定義する)
+static void touch(int r, int pos) {
+  if (pos < start[r]) start[r] = pos;
+  if (end[r] < pos) end[r] = pos;
+}
+
+/*
+  1つのブロックの中だけで、定義してから使う仮想レジスタは生存解析しなくてよい
+  それ以外(ブロックをまたぐもの、変数)に0からの番号を振り、その数を返す
+ */
+static int *gidx;  // 仮想レジスタの生存解析での番号(-1なら対象外)
+
+static int number_globals(void) {
+  int *home = arena_alloc((fn->nvregs + 1) * sizeof(int));  // 最初に現れたブロック
+  for (int r = 0; r <= fn->nvregs; r++) gidx[r] = -1;
+
+  int n = 0;
+  int regs[6];
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    for (int i = 0; i < bb->len; i++) {
+      int def;
+      int nregs = ir_regs(&bb->ir[i], regs, &def);
+
+      // 定義より先に使うもの、別のブロックで使うものが対象
+      for (int j = 0; j < nregs; j++) {
+        int r = regs[j];
+        if (gidx[r] == -1 && home[r] != bb->label) gidx[r] = n++;
+      }
+      if (def) {
+        if (gidx[def] == -1 && home[def] && home[def] != bb->label)
+          gidx[def] = n++;
+        home[def] = bb->label;
+      }
+    }
+  }
+  return n;
+}
+
+/*
+  ブロックごとに、入口と出口で生きている仮想レジスタ(gidxの番号のビット)を求める
+  live_out = 後続のブロックのlive_inの和
+  live_in  = (live_out - ブロックで定義するもの) + 定義より先に使うもの
+  変化がなくなるまで、後ろのブロックから繰り返し計算する
+ */
+static void analyze_liveness(int nglobals) {
+  int words = (nglobals + 63) / 64;
+
+  int nbbs = 0;
+  for (BB *bb = fn->bbs; bb; bb = bb->next) nbbs++;
+  BB **bbs = arena_alloc(nbbs * sizeof(BB *));
+  uint64_t **use = arena_alloc(nbbs * sizeof(uint64_t *));
+  uint64_t **def = arena_alloc(nbbs * sizeof(uint64_t *));
+
+  int k = 0;
+  for (BB *bb = fn->bbs; bb; bb = bb->next, k++) {
+    bbs[k] = bb;
+    bb->live_in = arena_alloc(words * sizeof(uint64_t));
+    bb->live_out = arena_alloc(words * sizeof(uint64_t));
+    use[k] = arena_alloc(words * sizeof(uint64_t));
+    def[k] = arena_alloc(words * sizeof(uint64_t));
+
+    int regs[6];
+    for (int i = 0; i < bb->len; i++) {
+      int d;
+      int nregs = ir_regs(&bb->ir[i], regs, &d);
+      for (int j = 0; j < nregs; j++) {
+        int g = gidx[regs[j]];
+        if (g != -1 && !(def[k][g / 64] & (1ul << (g % 64))))
+          use[k][g / 64] |= 1ul << (g % 64);
+      }
+      if (d && gidx[d] != -1) def[k][gidx[d] / 64] |= 1ul << (gidx[d] % 64);
+    }
+  }
+
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (int k = nbbs - 1; k >= 0; k--) {
+      BB *bb = bbs[k];
+      for (int w = 0; w < words; w++) {
+        uint64_t out = 0;
+        for (int s = 0; s < bb->nsucc; s++) out |= bb->succ[s]->live_in[w];
+        uint64_t in = use[k][w] | (out & ~def[k][w]);
+        if (in != bb->live_in[w]) changed = true;
+        bb->live_out[w] = out;
+        bb->live_in[w] = in;
+      }
+    }
+  }
+}
+
+// ブロックの入口・出口で生きている仮想レジスタの区間を、そこまで広げる
+static void extend_live_ranges(int nglobals) {
+  int *reg_of = arena_alloc((nglobals + 1) * sizeof(int));
+  for (int r = 1; r <= fn->nvregs; r++)
+    if (gidx[r] != -1) reg_of[gidx[r]] = r;
+
+  int words = (nglobals + 63) / 64;
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    for (int w = 0; w < words; w++) {
+      for (uint64_t in = bb->live_in[w]; in; in &= in - 1)
+        touch(reg_of[w * 64 + __builtin_ctzl(in)], bb->first);
+      for (uint64_t out = bb->live_out[w]; out; out &= out - 1)
+        touch(reg_of[w * 64 + __builtin_ctzl(out)], bb->last);
+    }
+  }
+}
+
+void alloc_regs(Function *f) {
+  fn = f;
+  int nvregs = fn->nvregs;
+  start = arena_alloc((nvregs + 1) * sizeof(int));
+  end = arena_alloc((nvregs + 1) * sizeof(int));
+  gidx = arena_alloc((nvregs + 1) * sizeof(int));
+  for (int r = 0; r <= nvregs; r++) {
+    start[r] = INT_MAX;
+    end[r] = -1;
+  }
+
+  // 位置を付け、定義と使用の位置を区間に含める
+  // 0は関数の入口で、引数はここで値を受け取る
+  for (VarList *vl = fn->params; vl; vl = vl->next)
+    if (vl->var->vreg) touch(vl->var->vreg, 0);
+
+  int pos = 1;
+  int ncalls = 0;
+  int regs[6];
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    bb->first = pos++;
+    for (int i = 0; i < bb->len; i++, pos++) {
+      IR *ir = &bb->ir[i];
+      int def;
+      int nregs = ir_regs(ir, regs, &def);
+      for (int j = 0; j < nregs; j++) touch(regs[j], pos);
+      if (def) touch(def, pos);
+      if (ir->op == IR_CALL) ncalls++;
+    }
+    bb->last = pos - 1;
+  }
+
+  int nglobals = number_globals();
+  analyze_liveness(nglobals);
+  extend_live_ranges(nglobals);
+
+  // calls_upto[p]は位置p以前にある関数呼び出しの数
+  int *calls_upto = arena_alloc((pos + 1) * sizeof(int));
+  if (ncalls) {
+    int p = 1;
+    for (BB *bb = fn->bbs; bb; bb = bb->next) {
+      calls_upto[p] = calls_upto[p - 1];
+      p++;
+      for (int i = 0; i < bb->len; i++, p++)
+        calls_upto[p] = calls_upto[p - 1] + (bb->ir[i].op == IR_CALL);
+    }
+  }
+
+  // 使われている仮想レジスタを区間の始まりの順に並べる
+  // 始まりは0からposまでなので、数え上げソートで並べる
+  int *bucket = arena_alloc((pos + 1) * sizeof(int));
+  for (int r = 1; r <= nvregs; r++)
+    if (end[r] != -1) bucket[start[r]]++;
+  for (int p = 0, sum = 0; p <= pos; p++) {
+    int cnt = bucket[p];
+    bucket[p] = sum;
+    sum += cnt;
+  }
+  int *order = arena_alloc(nvregs * sizeof(int));
+  int n = 0;
+  for (int r = 1; r <= nvregs; r++) {
+    if (end[r] == -1) continue;
+    order[bucket[start[r]]++] = r;
+    n++;
+  }
+
+  fn->loc = arena_alloc((nvregs + 1) * sizeof(int));
+  for (int r = 0; r <= nvregs; r++) fn->loc[r] = -1;  // スタックに置くもの
+
+  // active[reg]はそのレジスタを使っている仮想レジスタ(空いていれば0)
+  int active[NUM_ALLOC_REGS] = {0};
+  fn->used_regs = 0;
+
+  for (int i = 0; i < n; i++) {
+    int r = order[i];
+
+    // 区間の中に関数呼び出しがあれば、callee-savedしか使えない
+    // (区間の端の呼び出しは、引数を渡すか戻り値を受け取るだけなのでよい)
+    bool crosses = end[r] - start[r] > 1 &&
+                   calls_upto[end[r] - 1] - calls_upto[start[r]] > 0;
+    Reg cand[NUM_CALLER_SAVED + NUM_CALLEE_SAVED];
+    int ncand = 0;
+    if (!crosses)
+      for (int j = 0; j < NUM_CALLER_SAVED; j++) cand[ncand++] = caller_saved[j];
+    for (int j = 0; j < NUM_CALLEE_SAVED; j++) cand[ncand++] = callee_saved[j];
+
+    // 区間の終わったものを空けながら、空きと、終わりが最も遠いものを探す
+    // 同じ位置で終わるものと始まるものは、読んでから書くので重ならない
+    int free_reg = -1;
+    int furthest = -1;
+    for (int j = 0; j < ncand; j++) {
+      Reg reg = cand[j];
+      if (active[reg] && end[active[reg]] <= start[r]) active[reg] = 0;
+      if (!active[reg]) {
+        if (free_reg == -1) free_reg = reg;
+        continue;
+      }
+      if (furthest == -1 || end[active[furthest]] < end[active[reg]])
+        furthest = reg;
+    }
+
+    int reg = free_reg;
+    if (reg == -1) {
+      // 空きがなければ、後まで使う方をスタックに置く
+      if (end[active[furthest]] <= end[r]) continue;
+      fn->loc[active[furthest]] = -1;
+      reg = furthest;
+    }
+    active[reg] = r;
+    fn->loc[r] = reg;
+    if (reg >= REG_RBX) fn->used_regs |= 1 << reg;
+  }
+
+  // フレームの先頭に、使ったcallee-savedのレジスタを退避する場所を取る
+  int offset = __builtin_popcount(fn->used_regs) * 8;
+
+  // メモリに置くローカル変数
+  for (VarList *vl = fn->locals; vl; vl = vl->next) {
+    Var *var = vl->var;
+    if (var->vreg) continue;
+    offset += var->ty->size;
+    offset = align_to(offset, var->ty->align);
+    var->offset = offset;
+  }
+
+  // spillした仮想レジスタ
+  offset = align_to(offset, 8);
+  for (int i = 0; i < n; i++) {
+    int r = order[i];
+    if (fn->loc[r] != -1) continue;
+    offset += 8;
+    fn->loc[r] = -offset;
+  }
+
+  // 関数を呼び出すときにRSPが16の倍数になるようにする
+  fn->stack_size = align_to(offset, 16);
+}
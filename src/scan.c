@@ -0,0 +1,160 @@
+#include "./9cc.h"
+
+//
+// 注釈：
+// 空白・コメント・識別子を読み飛ばす処理を、SSE2/AVX2で16〜32バイトずつ行う
+// どの処理も'\0'で必ず止まるので、入力の終端を越えて読むことはない
+// (ブロックは境界に揃えて読むので、ページをまたいで読むこともない)
+//
+
+static char *scalar_skip_space(char *p) {
+  while (isspace(*p)) p++;
+  return p;
+}
+
+static char *scalar_skip_line(char *p) {
+  while (*p != '\n' && *p) p++;
+  return p;
+}
+
+static char *scalar_find_comment_end(char *p) {
+  for (; *p; p++)
+    if (p[0] == '*' && p[1] == '/') return p;
+  return NULL;
+}
+
+static char *scalar_skip_ident(char *p) {
+  while (('a' <= (*p | 0x20) && (*p | 0x20) <= 'z') ||
+         ('0' <= *p && *p <= '9') || *p == '_')
+    p++;
+  return p;
+}
+
+#ifdef __x86_64__
+#include <immintrin.h>
+
+#define AVX2 __attribute__((target("avx2")))
+
+// 各バイトについて、条件を満たせば0xffになるベクトルを返す。
+// 符号なしの lo <= b <= hi は min(b - lo, hi - lo) == b - lo で比べる
+
+static __m128i sse2_in(__m128i b, char lo, char hi) {
+  __m128i x = _mm_sub_epi8(b, _mm_set1_epi8(lo));
+  return _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(hi - lo)), x);
+}
+
+static __m128i sse2_eq(__m128i b, char c) {
+  return _mm_cmpeq_epi8(b, _mm_set1_epi8(c));
+}
+
+// ' ', '\t', '\n', '\v', '\f', '\r'
+static __m128i sse2_space(__m128i b) {
+  return _mm_or_si128(sse2_eq(b, ' '), sse2_in(b, '\t', '\r'));
+}
+
+// [A-Za-z0-9_]
+static __m128i sse2_ident(__m128i b) {
+  __m128i alpha = sse2_in(_mm_or_si128(b, _mm_set1_epi8(0x20)), 'a', 'z');
+  __m128i digit = sse2_in(b, '0', '9');
+  return _mm_or_si128(_mm_or_si128(alpha, digit), sse2_eq(b, '_'));
+}
+
+AVX2 static __m256i avx2_in(__m256i b, char lo, char hi) {
+  __m256i x = _mm256_sub_epi8(b, _mm256_set1_epi8(lo));
+  return _mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8(hi - lo)), x);
+}
+
+AVX2 static __m256i avx2_eq(__m256i b, char c) {
+  return _mm256_cmpeq_epi8(b, _mm256_set1_epi8(c));
+}
+
+AVX2 static __m256i avx2_space(__m256i b) {
+  return _mm256_or_si256(avx2_eq(b, ' '), avx2_in(b, '\t', '\r'));
+}
+
+AVX2 static __m256i avx2_ident(__m256i b) {
+  __m256i alpha =
+      avx2_in(_mm256_or_si256(b, _mm256_set1_epi8(0x20)), 'a', 'z');
+  __m256i digit = avx2_in(b, '0', '9');
+  return _mm256_or_si256(_mm256_or_si256(alpha, digit), avx2_eq(b, '_'));
+}
+
+// ブロック単位で`mask_of`が0でない最初のバイトを探す。
+// 最初のブロックは境界に揃えて読み、p より前のビットは落とす
+#define DEFINE_FIND(attr, name, width, load, mask_of)  \
+  attr static char *name(char *p) {                    \
+    uintptr_t off = (uintptr_t)p & (width - 1);        \
+    char *blk = p - off;                               \
+    uint32_t mask = mask_of(load(blk)) & (~0u << off); \
+    while (!mask) {                                    \
+      blk += width;                                    \
+      mask = mask_of(load(blk));                       \
+    }                                                  \
+    return blk + __builtin_ctz(mask);                  \
+  }
+
+#define sse2_load(p) _mm_load_si128((__m128i *)(p))
+#define avx2_load(p) _mm256_load_si256((__m256i *)(p))
+
+#define sse2_mask(v) (uint32_t) _mm_movemask_epi8(v)
+#define sse2_not_space(b) (~sse2_mask(sse2_space(b)) & 0xffff)
+#define sse2_not_ident(b) (~sse2_mask(sse2_ident(b)) & 0xffff)
+#define sse2_newline(b) \
+  sse2_mask(_mm_or_si128(sse2_eq(b, '\n'), sse2_eq(b, 0)))
+#define sse2_star(b) sse2_mask(_mm_or_si128(sse2_eq(b, '*'), sse2_eq(b, 0)))
+
+#define avx2_mask(v) (uint32_t) _mm256_movemask_epi8(v)
+#define avx2_not_space(b) ~avx2_mask(avx2_space(b))
+#define avx2_not_ident(b) ~avx2_mask(avx2_ident(b))
+#define avx2_newline(b) \
+  avx2_mask(_mm256_or_si256(avx2_eq(b, '\n'), avx2_eq(b, 0)))
+#define avx2_star(b) \
+  avx2_mask(_mm256_or_si256(avx2_eq(b, '*'), avx2_eq(b, 0)))
+
+DEFINE_FIND(, sse2_skip_space, 16, sse2_load, sse2_not_space)
+DEFINE_FIND(, sse2_skip_line, 16, sse2_load, sse2_newline)
+DEFINE_FIND(, sse2_find_star, 16, sse2_load, sse2_star)
+DEFINE_FIND(, sse2_skip_ident, 16, sse2_load, sse2_not_ident)
+
+DEFINE_FIND(AVX2, avx2_skip_space, 32, avx2_load, avx2_not_space)
+DEFINE_FIND(AVX2, avx2_skip_line, 32, avx2_load, avx2_newline)
+DEFINE_FIND(AVX2, avx2_find_star, 32, avx2_load, avx2_star)
+DEFINE_FIND(AVX2, avx2_skip_ident, 32, avx2_load, avx2_not_ident)
+
+// '*'を探し、直後が'/'でなければその次から探し直す
+static char *sse2_find_comment_end(char *p) {
+  for (p = sse2_find_star(p); *p; p = sse2_find_star(p + 1))
+    if (p[1] == '/') return p;
+  return NULL;
+}
+
+AVX2 static char *avx2_find_comment_end(char *p) {
+  for (p = avx2_find_star(p); *p; p = avx2_find_star(p + 1))
+    if (p[1] == '/') return p;
+  return NULL;
+}
+#endif
+
+char *(*skip_space)(char *p) = scalar_skip_space;
+char *(*skip_line)(char *p) = scalar_skip_line;
+char *(*find_comment_end)(char *p) = scalar_find_comment_end;
+char *(*skip_ident)(char *p) = scalar_skip_ident;
+
+// 実行中のCPUが対応している一番速い実装を選ぶ
+void init_scan(void) {
+#ifdef __x86_64__
+  if (__builtin_cpu_supports("avx2")) {
+    skip_space = avx2_skip_space;
+    skip_line = avx2_skip_line;
+    find_comment_end = avx2_find_comment_end;
+    skip_ident = avx2_skip_ident;
+    return;
+  }
+
+  // x86-64では SSE2 は常に使える
+  skip_space = sse2_skip_space;
+  skip_line = sse2_skip_line;
+  find_comment_end = sse2_find_comment_end;
+  skip_ident = sse2_skip_ident;
+#endif
+}
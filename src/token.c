@@ -6,7 +6,8 @@
 
 char *filename;
 char *user_input;  // 入力プログラム
-Token *token;      // 現在着目しているトークン
+TokenBuf tokens;   // 入力全体のトークン列
+Token token;       // 現在着目しているトークン
 
 // エラーを報告し、終了する関数
 void error(char *fmt, ...) {
@@ -17,19 +18,52 @@ void error(char *fmt, ...) {
   exit(1);
 }
 
-// 以下の形式でエラーメッセージを報告し、終了する関数
+// 行の先頭位置の表
+typedef struct {
+  uint32_t *starts;  // 各行の先頭のuser_inputからのオフセット(昇順)
+  int cnt;
+  int cap;
+} LineTable;
+
+// 入力全体の行の表。字句解析の時に作り、エラー箇所の行を二分探索で求める
+static LineTable lines;
+
+static void add_line(LineTable *t, char *start) {
+  if (t->cnt == t->cap) {
+    t->cap = t->cap ? t->cap * 2 : 1024;
+    t->starts = realloc(t->starts, t->cap * sizeof(uint32_t));
+  }
+  t->starts[t->cnt++] = start - user_input;
+}
+
+// [p, end)の中にある改行の次の位置を行の先頭として`t`に追加する
+static void add_line_starts(LineTable *t, char *p, char *end) {
+  while ((p = memchr(p, '\n', end - p))) add_line(t, ++p);
+}
+
+int error_count;         // これまでに報告した構文エラーの数
+jmp_buf *error_recovery;  // 構文エラーから復帰する位置。NULLならそこで終了する
+
+// 以下の形式でエラーメッセージを報告する関数
+// 復帰する位置が設定されていればそこへ戻り、なければ終了する
 static void verror_at(char *loc, char *fmt, va_list ap) {
   // Find a line containing `loc`.
-  char *line = loc;
-  while (user_input < line && line[-1] != '\n') line--;
+  uint32_t off = loc - user_input;
+  int lo = 0;
+  int hi = lines.cnt - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (lines.starts[mid] <= off)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
 
-  char *end = loc;
-  while (*end != '\n') end++;
+  char *line = user_input + lines.starts[lo];
+  char *end = lo + 1 < lines.cnt ? user_input + lines.starts[lo + 1] - 1 : loc;
 
   // Get a line number.
-  int line_num = 1;
-  for (char *p = user_input; p < line; p++)
-    if (*p == '\n') line_num++;
+  int line_num = lo + 1;
 
   // Print out the line.
   int indent = fprintf(stderr, "%s:%d: ", filename, line_num);
@@ -41,7 +75,13 @@ static void verror_at(char *loc, char *fmt, va_list ap) {
   fprintf(stderr, "^ ");
   vfprintf(stderr, fmt, ap);
   fprintf(stderr, "\n");
-  exit(1);
+
+  if (!error_recovery) exit(1);
+  if (++error_count >= max_errors) {
+    if (max_errors > 1) fprintf(stderr, "too many errors, stopping\n");
+    exit(1);
+  }
+  longjmp(*error_recovery, 1);
 }
 
 // エラー箇所を報告し、終了する関数
@@ -52,31 +92,41 @@ void error_at(char *loc, char *fmt, ...) {
 }
 
 // Reports an error location and exit.
-void error_tok(Token *tok, char *fmt, ...) {
+void error_tok(Token tok, char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  verror_at(tok->str, fmt, ap);
+  verror_at(tok_str(tok), fmt, ap);
 }
 
+// 予約語と区切り文字の綴り。エラーメッセージに使う
+static char *tok_spelling[] = {
+    [TK_RETURN] = "return", [TK_IF] = "if",         [TK_ELSE] = "else",
+    [TK_WHILE] = "while",   [TK_FOR] = "for",       [TK_INT] = "int",
+    [TK_CHAR] = "char",     [TK_SHORT] = "short",   [TK_LONG] = "long",
+    [TK_SIZEOF] = "sizeof", [TK_STRUCT] = "struct", [TK_EQ] = "==",
+    [TK_NE] = "!=",         [TK_LE] = "<=",         [TK_GE] = ">=",
+    [TK_LT] = "<",          [TK_GT] = ">",          [TK_ASSIGN] = "=",
+    [TK_PLUS] = "+",        [TK_MINUS] = "-",       [TK_STAR] = "*",
+    [TK_SLASH] = "/",       [TK_AMP] = "&",         [TK_LPAREN] = "(",
+    [TK_RPAREN] = ")",      [TK_LBRACE] = "{",      [TK_RBRACE] = "}",
+    [TK_LBRACKET] = "[",    [TK_RBRACKET] = "]",    [TK_SEMI] = ";",
+    [TK_COMMA] = ",",       [TK_DOT] = ".",
+};
+
 /*
-  現在のトークンが `op` にマッチするか？
+  現在のトークンが`kind`の予約語(または区切り文字)か？
   さらに、トークンを1つ読み進める。
-  @param op operator(演算子)
  */
-Token *consume(char *op) {
-  if (token->kind != TK_RESERVED || strlen(op) != token->len ||
-      strncmp(token->str, op, token->len))
-    return NULL;
-  Token *t = token;
-  token = token->next;
-  return t;
-}
-
-// 現在のトークンが与えられた文字列にマッチした場合、trueを返します。
-Token *peek(char *s) {
-  if (token->kind != TK_RESERVED || strlen(s) != token->len ||
-      strncmp(token->str, s, token->len))
-    return NULL;
+Token consume_id(TokenKind kind) {
+  if (tok_kind(token) != kind) return 0;
+  Token tok = token;
+  next_token();
+  return tok;
+}
+
+// 現在のトークンが`kind`の場合、そのトークンを返します。
+Token peek_id(TokenKind kind) {
+  if (tok_kind(token) != kind) return 0;
   return token;
 }
 
@@ -85,83 +135,236 @@ Token *peek(char *s) {
   現在のトークンを返し、トークンを1つ読み進める
   それ以外はnull
  */
-Token *consume_ident(void) {
-  if (token->kind != TK_IDENT) return NULL;
-  Token *t = token;
-  token = token->next;
-  return t;
+Token consume_ident(void) {
+  if (tok_kind(token) != TK_IDENT) return 0;
+  Token tok = token;
+  next_token();
+  return tok;
 }
 
-//  現在のトークンが与えられた文字列であることを確認し、トークンを1つ読み進める。
+//  現在のトークンが`kind`であることを確認し、トークンを1つ読み進める。
 // それ以外の場合にはエラーを報告する。
-void expect(char *s) {
-  if (!peek(s)) error_tok(token, "expected \"%s\"", s);
-  token = token->next;
+void expect_id(TokenKind kind) {
+  if (tok_kind(token) != kind)
+    error_tok(token, "expected \"%s\"", tok_spelling[kind]);
+  next_token();
 }
 
 // 現在のトークンの型が数値(TK_NUM)の場合、トークンを1つ読み進めてその数値を返す。
 // それ以外の場合にはエラーを報告する。
 long expect_number(void) {
-  if (token->kind != TK_NUM) error_tok(token, "数ではありません");
-  long val = token->val;
-  token = token->next;
+  if (tok_kind(token) != TK_NUM) error_tok(token, "数ではありません");
+  long val = tokens.val[tok_slot(token)].num;
+  next_token();
   return val;
 }
 
-// 現在のトークンの型が識別子(TK_IDENT)の場合、トークンを1つ読み進めてその文字列を返す。
+// 現在のトークンの型が識別子(TK_IDENT)の場合、トークンを1つ読み進めてその名前を返す。
+// 名前はinternされているので、ポインタの比較で同じ名前かどうかがわかる。
 // それ以外の場合にはエラーを報告する。
 char *expect_ident(void) {
-  if (token->kind != TK_IDENT) error_tok(token, "識別子ではありません");
-  char *s = strndup(token->str, token->len);
-  token = token->next;
-  return s;
+  if (tok_kind(token) != TK_IDENT) error_tok(token, "識別子ではありません");
+  char *name = tok_ident(token);
+  next_token();
+  return name;
 }
 
 // 現在解析中の文字列が`;`のトークン型か？
-bool at_eof() { return token->kind == TK_EOF; }
-
-// 新しいトークンを作成してcurに繋げる
-static Token *new_token(TokenKind kind, Token *cur, char *str, int len) {
-  Token *tok = calloc(1, sizeof(Token));
-  tok->kind = kind;
-  tok->str = str;
-  tok->len = len;
-  cur->next = tok;
-  return tok;
+bool at_eof() { return tok_kind(token) == TK_EOF; }
+
+// 識別子の表(オープンアドレス法のハッシュ表)
+// 同じ綴りの識別子には常に同じ文字列へのポインタを返す。
+// 並列字句解析では複数のスレッドから使うので、ハッシュ値の上位ビットで
+// 小さな表(シャード)に分け、それぞれをロックで守る
+#define IDENT_SHARDS 64
+
+typedef struct {
+  pthread_mutex_t lock;
+  char **names;
+  uint32_t *hashes;
+  int cap;  // 2のべき乗
+  int cnt;
+} IdentShard;
+
+static IdentShard idents[IDENT_SHARDS];
+static pthread_once_t idents_once = PTHREAD_ONCE_INIT;
+
+// シャードのロックは翻訳単位をまたいで使い回すので、一度だけ初期化する
+static void init_idents(void) {
+  for (int i = 0; i < IDENT_SHARDS; i++)
+    pthread_mutex_init(&idents[i].lock, NULL);
 }
 
-/*
-  pとqが一致するか、qの文字数分の文字を比較する関数
-  @param *p トークンとして渡ってきた文字
-  @param *q 比較演算子
- */
-bool startswith(char *p, char *q) { return strncmp(p, q, strlen(q)) == 0; }
+static uint32_t fnv_hash(char *s, int len) {
+  uint32_t hash = 2166136261;
+  for (int i = 0; i < len; i++) hash = (hash ^ (unsigned char)s[i]) * 16777619;
+  return hash;
+}
 
-static bool is_alpha(char c) {
-  return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_';
+// 表のnamesの中で`s`を入れるべき位置を返す
+static int ident_slot(IdentShard *sh, char *s, int len, uint32_t hash) {
+  int mask = sh->cap - 1;
+  for (int i = hash & mask;; i = (i + 1) & mask) {
+    char *name = sh->names[i];
+    if (!name) return i;
+    if (sh->hashes[i] == hash && !strncmp(name, s, len) && !name[len])
+      return i;
+  }
 }
 
-// 引数`c`は半角英字(is_alpha)、数字、アンダーバーかを判定する関数
-static bool is_alnum(char c) { return is_alpha(c) || ('0' <= c && c <= '9'); }
+static void grow_idents(IdentShard *sh) {
+  char **names = sh->names;
+  uint32_t *hashes = sh->hashes;
+  int cap = sh->cap;
 
-/* *pに渡されたトークンが予約語と一致したらそれを返す関数 */
-static char *starts_with_reserved(char *p) {
-  // Keyword
-  static char *kw[] = {"return", "if",   "else",   "while", "for",
-                       "int",    "char", "sizeof", "struct"};
+  sh->cap = cap ? cap * 2 : 256;
+  sh->names = calloc(sh->cap, sizeof(char *));
+  sh->hashes = calloc(sh->cap, sizeof(uint32_t));
 
-  for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++) {
-    int len = strlen(kw[i]);
-    if (startswith(p, kw[i]) && !is_alnum(p[len])) return kw[i];
+  for (int i = 0; i < cap; i++) {
+    if (!names[i]) continue;
+    int j = ident_slot(sh, names[i], strlen(names[i]), hashes[i]);
+    sh->names[j] = names[i];
+    sh->hashes[j] = hashes[i];
   }
+  free(names);
+  free(hashes);
+}
 
-  // Multi-letter punctuator(2文字以上の区切り文字。比較演算子)
-  static char *ops[] = {"==", "!=", "<=", ">="};
+static char *intern_locked(IdentShard *sh, char *s, int len, uint32_t hash) {
+  if (sh->cnt * 2 >= sh->cap) grow_idents(sh);
 
-  for (int i = 0; i < sizeof(ops) / sizeof(*ops); i++)
-    if (startswith(p, ops[i])) return ops[i];
+  int i = ident_slot(sh, s, len, hash);
+  if (sh->names[i]) return sh->names[i];
 
-  return NULL;
+  // 名前は翻訳単位の終わりにarena_resetで捨てられる
+  char *name = arena_alloc_local(len + 1);
+  memcpy(name, s, len);
+
+  sh->names[i] = name;
+  sh->hashes[i] = hash;
+  sh->cnt++;
+  return name;
+}
+
+// 前の翻訳単位の名前は既に捨てられているので、表を空にする
+static void reset_idents(void) {
+  for (int i = 0; i < IDENT_SHARDS; i++) {
+    IdentShard *sh = &idents[i];
+    if (sh->cap) memset(sh->names, 0, sh->cap * sizeof(char *));
+    sh->cnt = 0;
+  }
+}
+
+// `len`文字の識別子`s`に対応する一意な文字列を返す
+char *intern(char *s, int len) {
+  uint32_t hash = fnv_hash(s, len);
+  IdentShard *sh = &idents[hash >> 26];
+
+  pthread_mutex_lock(&sh->lock);
+  char *name = intern_locked(sh, s, len, hash);
+  pthread_mutex_unlock(&sh->lock);
+  return name;
+}
+
+static void buf_reserve(TokenBuf *buf, int n) {
+  buf->mask = UINT32_MAX;
+  if (buf->cnt + n <= buf->cap) return;
+
+  while (buf->cnt + n > buf->cap) buf->cap = buf->cap ? buf->cap * 2 : 1024;
+  buf->kind = realloc(buf->kind, buf->cap);
+  buf->loc = realloc(buf->loc, buf->cap * sizeof(uint32_t));
+  buf->len = realloc(buf->len, buf->cap * sizeof(uint32_t));
+  buf->val = realloc(buf->val, buf->cap * sizeof(TokenVal));
+}
+
+// トークン列`buf`の末尾に新しいトークンを追加し、その値を入れる場所を返す
+// リングバッファの場合、空きはlex_moreがあらかじめ確保しておく
+static TokenVal *new_token(TokenBuf *buf, TokenKind kind, char *str, int len) {
+  if (!buf->ring) buf_reserve(buf, 1);
+
+  uint32_t i = buf->cnt++ & buf->mask;
+  buf->kind[i] = kind;
+  buf->loc[i] = str - user_input;
+  buf->len[i] = len;
+  buf->val[i].num = 0;
+  return &buf->val[i];
+}
+
+static bool is_alpha(char c) {
+  return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_';
+}
+
+/*
+  識別子として読んだ`len`文字の文字列が予約語ならその種類を、
+  そうでなければTK_IDENTを返す関数
+  先頭の文字で候補を絞り込み、長さが同じ予約語とだけ比較する
+ */
+static TokenKind keyword_kind(char *p, int len) {
+  switch (*p) {
+    case 'c':
+      if (len == 4 && !memcmp(p, "char", 4)) return TK_CHAR;
+      break;
+    case 'e':
+      if (len == 4 && !memcmp(p, "else", 4)) return TK_ELSE;
+      break;
+    case 'f':
+      if (len == 3 && !memcmp(p, "for", 3)) return TK_FOR;
+      break;
+    case 'i':
+      if (len == 2 && p[1] == 'f') return TK_IF;
+      if (len == 3 && !memcmp(p, "int", 3)) return TK_INT;
+      break;
+    case 'l':
+      if (len == 4 && !memcmp(p, "long", 4)) return TK_LONG;
+      break;
+    case 'r':
+      if (len == 6 && !memcmp(p, "return", 6)) return TK_RETURN;
+      break;
+    case 's':
+      if (len == 5 && !memcmp(p, "short", 5)) return TK_SHORT;
+      if (len == 6 && !memcmp(p, "sizeof", 6)) return TK_SIZEOF;
+      if (len == 6 && !memcmp(p, "struct", 6)) return TK_STRUCT;
+      break;
+    case 'w':
+      if (len == 5 && !memcmp(p, "while", 5)) return TK_WHILE;
+      break;
+  }
+  return TK_IDENT;
+}
+
+// 1文字の区切り文字の種類。0(TK_IDENT)は区切り文字でないことを表す
+static unsigned char punct1[128] = {
+    ['<'] = TK_LT,       ['>'] = TK_GT,       ['='] = TK_ASSIGN,
+    ['+'] = TK_PLUS,     ['-'] = TK_MINUS,    ['*'] = TK_STAR,
+    ['/'] = TK_SLASH,    ['&'] = TK_AMP,      ['('] = TK_LPAREN,
+    [')'] = TK_RPAREN,   ['{'] = TK_LBRACE,   ['}'] = TK_RBRACE,
+    ['['] = TK_LBRACKET, [']'] = TK_RBRACKET, [';'] = TK_SEMI,
+    [','] = TK_COMMA,    ['.'] = TK_DOT,
+};
+
+// Multi-letter punctuator(2文字の区切り文字)の種類を1文字目と2文字目で引く表
+static unsigned char punct2[128][128] = {
+    ['=']['='] = TK_EQ,
+    ['!']['='] = TK_NE,
+    ['<']['='] = TK_LE,
+    ['>']['='] = TK_GE,
+};
+
+/*
+  *pから始まる区切り文字の種類を返し、その長さを`len`に入れる関数
+  区切り文字でなければTK_IDENTを返す
+ */
+static TokenKind read_punct(char *p, int *len) {
+  unsigned char c0 = p[0], c1 = p[1];
+  if (c0 >= 128) return TK_IDENT;
+
+  if (c1 < 128 && punct2[c0][c1]) {
+    *len = 2;
+    return punct2[c0][c1];
+  }
+  *len = 1;
+  return punct1[c0];
 }
 
 static char get_escape_char(char c) {
@@ -189,102 +392,314 @@ static char get_escape_char(char c) {
   }
 }
 
-static Token *read_string_literal(Token *cur, char *start) {
+/*
+  文字列リテラルを読んで`buf`に追加し、その次の位置を返す
+  エスケープを含まない場合、内容は入力をそのまま指す
+  `spec`がtrueの場合、エラーは報告せずにNULLを返す
+ */
+static char *read_string_literal(TokenBuf *buf, char *start, bool spec) {
+  // 閉じる'"'を探す
+  bool escaped = false;
   char *p = start + 1;
-  char buf[1024];
-  int len = 0;
-
-  for (;;) {
-    if (len == sizeof(buf)) error_at(start, "string literal too large");
-    if (*p == '\0') error_at(start, "unclosed string literal");
-    if (*p == '"') break;
-
+  for (; *p != '"'; p++) {
     if (*p == '\\') {
+      escaped = true;
       p++;
-      buf[len++] = get_escape_char(*p++);
-    } else {
-      buf[len++] = *p++;
+    }
+    if (*p == '\0') {
+      if (spec) return NULL;
+      error_at(start, "unclosed string literal");
     }
   }
 
-  Token *tok = new_token(TK_STR, cur, start, p - start + 1);
-  tok->contents = malloc(len + 1);
-  memcpy(tok->contents, buf, len);
-  tok->contents[len] = '\0';
-  tok->cont_len = len + 1;
-  return tok;
+  // 並列字句解析ではワーカースレッドからも呼ばれるので、
+  // スレッドごとのブロックに置く。翻訳単位の終わりにarena_resetで捨てられる
+  StrLit *str = arena_alloc_local(sizeof(StrLit));
+  if (!escaped) {
+    str->contents = start + 1;
+    str->cont_len = p - start;
+  } else {
+    // エスケープを展開すると元より短くなるので、元の長さ分あれば足りる
+    char *q = str->contents = arena_alloc_local(p - start);
+    for (char *r = start + 1; r < p; r++)
+      *q++ = *r == '\\' ? get_escape_char(*++r) : *r;
+    str->cont_len = q - str->contents + 1;
+  }
+
+  new_token(buf, TK_STR, start, p - start + 1)->str = str;
+  return p + 1;
 }
 
-// `user_input` をトークン化して、新しいトークンを返す
-Token *tokenize(void) {
-  char *p = user_input;
-  Token head = {};
-  Token *cur = &head;
+/*
+  字句解析の1ステップ。`p`から空白かコメントを1つ読み飛ばすか、
+  トークンを1つ読んで`buf`に追加し、次に読む位置を返す。
+  結果は`p`の位置だけで決まり、トークンはそれを読み始めた位置から始まる。
+  `spec`がtrueの場合、エラーは報告せずにNULLを返す
+ */
+static char *lex_step(TokenBuf *buf, char *p, bool spec) {
+  // 空白文字をスキップ
+  if (isspace(*p)) return skip_space(p + 1);
+
+  // 行コメントをスキップ
+  if (strncmp(p, "//", 2) == 0) return skip_line(p + 2);
+
+  // ブロックコメントをスキップ
+  if (strncmp(p, "/*", 2) == 0) {
+    char *q = find_comment_end(p + 2);
+    if (q) return q + 2;
+    if (spec) return NULL;
+    error_at(p, "コメントが閉じられていません");
+  }
 
-  while (*p) {
-    // 空白文字をスキップ
-    if (isspace(*p)) {
-      p++;
-      continue;
-    }
+  // String literal
+  if (*p == '"') return read_string_literal(buf, p, spec);
+
+  // 識別子または予約語
+  if (is_alpha(*p)) {
+    char *q = p;
+    p = skip_ident(p + 1);
+    TokenKind kind = keyword_kind(q, p - q);
+    TokenVal *val = new_token(buf, kind, q, p - q);
+    if (kind == TK_IDENT) val->ident = intern(q, p - q);
+    return p;
+  }
 
-    // 行コメントをスキップ
-    if (strncmp(p, "//", 2) == 0) {
-      p += 2;
-      while (*p != '\n') p++;
-      continue;
-    }
+  // 区切り文字
+  int len;
+  TokenKind kind = read_punct(p, &len);
+  if (kind != TK_IDENT) {
+    new_token(buf, kind, p, len);
+    return p + len;
+  }
 
-    // ブロックコメントをスキップ
-    if (strncmp(p, "/*", 2) == 0) {
-      char *q = strstr(p + 2, "*/");
-      if (!q) error_at(p, "コメントが閉じられていません");
-      p = q + 2;  // strstrは見つかったところのアドレスを返すので再度+2
-      continue;
-    }
+  // Integer literal
+  if (isdigit(*p)) {
+    char *q = p;
+    long val = strtol(p, &p, 10);
+    new_token(buf, TK_NUM, q, p - q)->num = val;
+    return p;
+  }
 
-    // String literal
-    if (*p == '"') {
-      cur = read_string_literal(cur, p);
-      p += cur->len;
-      continue;
-    }
+  if (spec) return NULL;
+  error_at(p, "トークナイズできません");
+}
 
-    // 予約語または比較演算子
-    char *kw = starts_with_reserved(p);
-    if (kw) {
-      int len = strlen(kw);
-      cur = new_token(TK_RESERVED, cur, p, len);
-      p += len;
-      continue;
-    }
+//
+// 並列字句解析
+// 入力を行の区切りでチャンクに分け、各チャンクを別スレッドで
+// 「チャンクの先頭はトークンの区切りである」と仮定して読む。
+// その後、前から順に仮定が正しかったかを確かめながら繋ぎ合わせる
+//
 
-    // Identifier
-    if (is_alpha(*p)) {
-      char *q = p++;
-      while (is_alnum(*p)) p++;
-      cur = new_token(TK_IDENT, cur, q, p - q);
-      continue;
+// 1スレッドあたりの最小の入力サイズ。これより小さく分けても速くならない
+#define MIN_CHUNK_SIZE (64 * 1024)
+
+typedef struct {
+  char *start;   // 受け持ちの先頭(行頭)
+  char *end;     // 受け持ちの末尾(次のチャンクの先頭)
+  char *stop;    // 実際に読み終えた位置。エラーで止まった場合はその位置
+  TokenBuf buf;  // 仮定のもとで読んだトークン列
+  LineTable lines;  // [start, end)の中の行の先頭
+} Chunk;
+
+static void *lex_chunk(void *arg) {
+  Chunk *c = arg;
+  char *p = c->start;
+
+  // チャンクは行の区切りで分けているので、行の表はそのまま繋げられる
+  add_line_starts(&c->lines, c->start, c->end);
+
+  while (p < c->end && *p) {
+    // 仮定が間違っていればエラーになりうるので、ここでは報告しない
+    char *q = lex_step(&c->buf, p, true);
+    if (!q) break;
+    p = q;
+  }
+  c->stop = p;
+  return NULL;
+}
+
+/*
+  チャンク`c`のトークンをtokensに繋げ、続きを読む位置を返す。
+  `pos`は直前までを正しく読み終えた位置で、c->startと一致していれば
+  cのトークンはそのまま使える。前のトークンやコメントがcの中まで続いていた場合
+  (またはエラーで止まっていた場合)、posから読み直し、cのトークンと位置が
+  揃ったところから残りを使う。lex_stepの結果は読み始めた位置だけで決まるので、
+  同じ位置から始まるトークンがあれば、それ以降はすべて一致する
+ */
+static char *stitch_chunk(Chunk *c, char *pos) {
+  TokenBuf *b = &c->buf;
+  int k = 0;
+
+  if (pos != c->start) {
+    for (;;) {
+      if (pos >= c->end || !*pos) return pos;
+
+      int cnt = tokens.cnt;
+      pos = lex_step(&tokens, pos, false);
+      if (tokens.cnt == cnt) continue;  // 空白かコメント
+
+      uint32_t loc = tokens.loc[cnt];
+      while (k < b->cnt && b->loc[k] < loc) k++;
+      if (k < b->cnt && b->loc[k] == loc) {
+        k++;
+        break;
+      }
     }
+  }
+
+  int n = b->cnt - k;
+  buf_reserve(&tokens, n);
+  memcpy(tokens.kind + tokens.cnt, b->kind + k, n);
+  memcpy(tokens.loc + tokens.cnt, b->loc + k, n * sizeof(uint32_t));
+  memcpy(tokens.len + tokens.cnt, b->len + k, n * sizeof(uint32_t));
+  memcpy(tokens.val + tokens.cnt, b->val + k, n * sizeof(TokenVal));
+  tokens.cnt += n;
+  return c->stop;
+}
+
+// 長さ`size`のuser_inputを`nthreads`個のスレッドで読み、
+// 最後まで読んだ位置を返す
+static char *tokenize_parallel(int nthreads, size_t size) {
+  if (nthreads > size / MIN_CHUNK_SIZE) nthreads = size / MIN_CHUNK_SIZE;
+  if (nthreads < 1) nthreads = 1;
 
-    // 1文字の区切り文字の場合
-    if (ispunct(*p)) {
-      cur = new_token(TK_RESERVED, cur, p++, 1);
-      continue;
+  // 行の区切りでほぼ等分する
+  Chunk *chunks = calloc(nthreads, sizeof(Chunk));
+  char *p = user_input;
+  for (int i = 0; i < nthreads; i++) {
+    char *end = user_input + size;
+    if (i < nthreads - 1) {
+      char *q = user_input + size / nthreads * (i + 1);
+      end = q > p ? skip_line(q) : p;
+      if (*end) end++;
     }
+    chunks[i].start = p;
+    chunks[i].end = end;
+    p = end;
+  }
+
+  pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+  for (int i = 1; i < nthreads; i++)
+    if (pthread_create(&threads[i], NULL, lex_chunk, &chunks[i]))
+      error("pthread_create: %s", strerror(errno));
+  lex_chunk(&chunks[0]);
+  for (int i = 1; i < nthreads; i++) pthread_join(threads[i], NULL);
+
+  // 繋ぎ合わせる途中でエラーを報告することがあるので、行の表を先に作る
+  for (int i = 0; i < nthreads; i++) {
+    LineTable *t = &chunks[i].lines;
+    for (int j = 0; j < t->cnt; j++)
+      add_line(&lines, user_input + t->starts[j]);
+    free(t->starts);
+  }
+
+  char *pos = user_input;
+  for (int i = 0; i < nthreads; i++) {
+    pos = stitch_chunk(&chunks[i], pos);
+
+    TokenBuf *b = &chunks[i].buf;
+    free(b->kind);
+    free(b->loc);
+    free(b->len);
+    free(b->val);
+  }
+  free(chunks);
+  free(threads);
+
+  // 最後のチャンクがエラーで止まっていれば、ここでそのエラーが報告される
+  while (*pos) pos = lex_step(&tokens, pos, false);
+  return pos;
+}
+
+//
+// 流し込み(streaming)字句解析
+// 構文解析がトークンを進めた時に、必要な分だけ字句解析を進める。
+// tokensはリングバッファで、現在のトークンより前のトークンは
+// 新しいトークンで上書きされていく。構文解析は1トークンしか先読みせず、
+// 値を引き直すのも直前の数トークンだけなので、リングバッファは小さくてよい
+//
+
+// リングバッファの大きさ
+#define RING_SIZE 64
+
+static char *lex_pos;  // 次に読む位置
 
-    // Integer literal
-    if (isdigit(*p)) {
-      cur = new_token(TK_NUM, cur, p, 0);
-      char *q = p;
-      cur->val = strtol(p, &p, 10);
-      cur->len = q - p;
-      continue;
+// 番号`i`のトークンを返す
+static Token make_token(uint32_t i) {
+  return (uint64_t)tokens.loc[i & tokens.mask] << 32 | i;
+}
+
+// トークンを1つ読んでtokensに追加する
+static void lex_more(void) {
+  // 字句解析のエラーからは回復しない(一括で字句解析する場合と同じ)
+  jmp_buf *recovery = error_recovery;
+  error_recovery = NULL;
+
+  uint32_t cnt = tokens.cnt;
+  while (tokens.cnt == cnt) {
+    if (!*lex_pos) {
+      new_token(&tokens, TK_EOF, lex_pos, 0);
+      break;
     }
+    lex_pos = lex_step(&tokens, lex_pos, false);
+  }
+  error_recovery = recovery;
+}
+
+// 次のトークンに進む
+void next_token(void) {
+  uint32_t i = (uint32_t)token + 1;
+  if (i == tokens.cnt) lex_more();
+  token = make_token(i);
+}
 
-    error_at(p, "トークナイズできません");
+// `user_input` をトークン化して`tokens`に格納し、`token`を先頭に合わせる
+void tokenize(void) {
+  init_scan();
+  pthread_once(&idents_once, init_idents);
+  reset_idents();
+
+  // トークンと行の位置は32ビットのオフセットで持つので、
+  // 切り詰められる前に大きすぎるファイルを弾く
+  size_t size = strlen(user_input);
+  if (size > UINT32_MAX) error("%s: file too large", filename);
+
+  lines.cnt = 0;
+  add_line(&lines, user_input);
+
+  if (stream_lex) {
+    add_line_starts(&lines, user_input, user_input + size);
+    free(tokens.kind);  // 前の翻訳単位のリングバッファ
+    free(tokens.loc);
+    free(tokens.len);
+    free(tokens.val);
+    tokens.ring = true;
+    tokens.cap = RING_SIZE;
+    tokens.mask = RING_SIZE - 1;
+    tokens.kind = malloc(RING_SIZE);
+    tokens.loc = malloc(RING_SIZE * sizeof(uint32_t));
+    tokens.len = malloc(RING_SIZE * sizeof(uint32_t));
+    tokens.val = malloc(RING_SIZE * sizeof(TokenVal));
+    tokens.cnt = 1;  // 0番は無効なトークン
+
+    lex_pos = user_input;
+    lex_more();
+    token = make_token(1);
+    return;
+  }
+
+  buf_reserve(&tokens, 1);
+  tokens.cnt = 1;  // 0番は無効なトークン
+
+  char *p = user_input;
+  if (lex_threads > 1) {
+    p = tokenize_parallel(lex_threads, size);
+  } else {
+    add_line_starts(&lines, user_input, user_input + size);
+    while (*p) p = lex_step(&tokens, p, false);
   }
 
-  new_token(TK_EOF, cur, p, 0);
-  return head.next;
+  new_token(&tokens, TK_EOF, p, 0);
+  token = make_token(1);
 }
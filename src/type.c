@@ -1,63 +1,267 @@
 #include "9cc.h"
 
-Type *char_type = &(Type){TY_CHAR, 1};
-Type *int_type = &(Type){TY_INT, 8};
+Type *char_type = &(Type){TY_CHAR, 1, 1};
+Type *short_type = &(Type){TY_SHORT, 2, 2};
+Type *int_type = &(Type){TY_INT, 4, 4};
+Type *long_type = &(Type){TY_LONG, 8, 8};
 
-/* 渡されたType構造体のkindがTY_INTであるか */
-bool is_integer(Type *ty) { return ty->kind == TY_CHAR || ty->kind == TY_INT; }
+/* 渡されたType構造体が整数型であるか */
+bool is_integer(Type *ty) {
+  TypeKind k = ty->kind;
+  return k == TY_CHAR || k == TY_SHORT || k == TY_INT || k == TY_LONG;
+}
+
+// 算術演算の結果の型。どちらかがlongならlong、そうでなければintになる
+// (値そのものは常に64ビットのレジスタで計算する)
+static Type *arith_type(Type *lhs, Type *rhs) {
+  if (lhs->kind == TY_LONG || rhs->kind == TY_LONG) return long_type;
+  return int_type;
+}
+
+/*
+  ポインタと配列の型は(kind, base, array_len)ごとに1つだけ作り、ハッシュ表に登録する
+  同じ型は同じポインタになるので、型の比較はポインタの比較で済む
+  型はアリーナに置くので、翻訳単位ごとにreset_typesで表を空にする
+ */
+static Type **type_tab;
+static int type_tab_cap;
+static int type_tab_used;
+
+static uint32_t type_hash(TypeKind kind, Type *base, int len) {
+  uint64_t x = (uintptr_t)base ^ ((uint64_t)len << 8) ^ kind;
+  return x * 0x9e3779b97f4a7c15 >> 32;
+}
+
+// 型の入る場所を返す。表になければ空きの場所を返す
+static Type **type_slot(TypeKind kind, Type *base, int len) {
+  int mask = type_tab_cap - 1;
+  for (int i = type_hash(kind, base, len) & mask;; i = (i + 1) & mask) {
+    Type *ty = type_tab[i];
+    if (!ty || (ty->kind == kind && ty->base == base && ty->array_len == len))
+      return &type_tab[i];
+  }
+}
+
+static void grow_type_tab(void) {
+  Type **old = type_tab;
+  int old_cap = type_tab_cap;
+
+  type_tab_cap = old_cap ? old_cap * 2 : 256;
+  type_tab = calloc(type_tab_cap, sizeof(Type *));
+  for (int i = 0; i < old_cap; i++) {
+    Type *ty = old[i];
+    if (ty) *type_slot(ty->kind, ty->base, ty->array_len) = ty;
+  }
+  free(old);
+}
+
+// 登録済みの型を返す。なければ新しく作って登録する
+static Type *derived_type(TypeKind kind, Type *base, int len) {
+  if ((type_tab_used + 1) * 2 > type_tab_cap) grow_type_tab();
+
+  Type **slot = type_slot(kind, base, len);
+  if (*slot) return *slot;
+
+  Type *ty = arena_alloc(sizeof(Type));
+  ty->kind = kind;
+  ty->base = base;
+  ty->array_len = len;
+  *slot = ty;
+  type_tab_used++;
+  return ty;
+}
+
+// 表に登録した型を忘れる。アリーナをリセットするときに呼ぶ
+void reset_types(void) {
+  if (type_tab) memset(type_tab, 0, type_tab_cap * sizeof(Type *));
+  type_tab_used = 0;
+}
 
 // ポインタの構造体を作成し、返却する関数
 Type *pointer_to(Type *base) {
-  Type *ty = calloc(1, sizeof(Type));
-  ty->kind = TY_PTR;
+  Type *ty = derived_type(TY_PTR, base, 0);
   ty->size = 8;
-  ty->base = base;
+  ty->align = 8;
   return ty;
 }
 
-/* Type分のメモリを確保し、引数lenの数をty->size構造体に入れる */
+/* 引数lenの数の要素を持つ配列の型を返す */
 Type *array_of(Type *base, int len) {
-  Type *ty = calloc(1, sizeof(Type));
-  ty->kind = TY_ARRAY;
+  Type *ty = derived_type(TY_ARRAY, base, len);
   ty->size = base->size * len;
-  ty->base = base;
-  ty->array_len = len;
+  ty->align = base->align;
   return ty;
 }
 
-/* 渡されたノードに型ノードを追加する関数 */
-void add_type(Node *node) {
-  if (!node || node->ty) return;
+/*
+  構造体のレイアウトを決める
+  System V ABI(gccと同じ)に従い、各メンバーをその型のアラインメントに揃え、
+  構造体全体の大きさをメンバーの最大のアラインメントの倍数に切り上げる
+  --reorder-fieldsの場合は、アラインメントの大きい順にメンバーを置いて
+  詰め物を減らす(membersの並びは宣言順のまま、オフセットだけが変わる)
+ */
+static void layout_struct(Type *ty) {
+  int n = 0;
+  for (Member *mem = ty->members; mem; mem = mem->next) n++;
 
-  add_type(node->lhs);
-  add_type(node->rhs);
-  add_type(node->cond);
-  add_type(node->then);
-  add_type(node->els);
-  add_type(node->init);
-  add_type(node->inc);
+  Member **order = calloc(n, sizeof(Member *));
+  int i = 0;
+  for (Member *mem = ty->members; mem; mem = mem->next) order[i++] = mem;
 
-  for (Node *n = node->body; n; n = n->next) add_type(n);
-  for (Node *n = node->args; n; n = n->next) add_type(n);
+  // 安定な挿入ソートで、同じアラインメントのメンバーは宣言順を保つ
+  if (reorder_fields) {
+    for (int i = 1; i < n; i++) {
+      Member *mem = order[i];
+      int j = i;
+      for (; j > 0 && order[j - 1]->ty->align < mem->ty->align; j--)
+        order[j] = order[j - 1];
+      order[j] = mem;
+    }
+  }
+
+  int offset = 0;
+  ty->align = 1;
+  for (int i = 0; i < n; i++) {
+    Member *mem = order[i];
+    offset = align_to(offset, mem->ty->align);
+    mem->offset = offset;
+    offset += mem->ty->size;
+    if (ty->align < mem->ty->align) ty->align = mem->ty->align;
+  }
+  ty->size = align_to(offset, ty->align);
+  free(order);
+}
 
+// メンバーの名前を引くハッシュ表を作る。同じ名前なら先に宣言した方を使う
+static void build_member_table(Type *ty) {
+  int n = 0;
+  for (Member *mem = ty->members; mem; mem = mem->next) n++;
+
+  ty->mem_tab_cap = 4;
+  while (ty->mem_tab_cap < n * 2) ty->mem_tab_cap *= 2;
+  ty->mem_tab = arena_alloc(ty->mem_tab_cap * sizeof(Member *));
+
+  int mask = ty->mem_tab_cap - 1;
+  for (Member *mem = ty->members; mem; mem = mem->next) {
+    int i = name_hash(mem->name) & mask;
+    while (ty->mem_tab[i] && ty->mem_tab[i]->name != mem->name)
+      i = (i + 1) & mask;
+    if (!ty->mem_tab[i]) ty->mem_tab[i] = mem;
+  }
+}
+
+// 宣言順に並んだメンバーから構造体の型を作る
+Type *struct_type(Member *members) {
+  Type *ty = arena_alloc(sizeof(Type));
+  ty->kind = TY_STRUCT;
+  ty->members = members;
+  layout_struct(ty);
+  build_member_table(ty);
+  return ty;
+}
+
+// 構造体`ty`のメンバー`name`を返す。なければNULL
+Member *find_member(Type *ty, char *name) {
+  int mask = ty->mem_tab_cap - 1;
+  for (int i = name_hash(name) & mask; ty->mem_tab[i]; i = (i + 1) & mask)
+    if (ty->mem_tab[i]->name == name) return ty->mem_tab[i];
+  return NULL;
+}
+
+// add_typeで使う作業用のスタック。子より後に親を処理する(後順)ため、
+// 子を積んだ親には印(VISITED)を付けて積み直す
+#define VISITED (1u << 31)
+
+static NodeId *type_stack;
+static int type_stack_len;
+static int type_stack_cap;
+
+static void push_type_work(NodeId id) {
+  if (!id || node_at(id)->ty) return;
+  if (type_stack_len == type_stack_cap) {
+    type_stack_cap = type_stack_cap ? type_stack_cap * 2 : 256;
+    type_stack = realloc(type_stack, type_stack_cap * sizeof(NodeId));
+  }
+  type_stack[type_stack_len++] = id;
+}
+
+/*
+  ノードの子をすべて`fn`に渡す(リストの場合はその要素をすべて渡す)
+  子のフィールドは共用体で重なっているので、ノードの種類で辿り方を変える
+  構文木はいくらでも深くなりうるので、木を辿る処理はどれも再帰せず、
+  作業用のスタックに子を積んで辿る。そうすればCのスタックを使い切らない
+ */
+void visit_children(Node *node, void (*fn)(NodeId id)) {
+  if (node->kind == ND_BLOCK || node->kind == ND_STMT_EXPR ||
+      node->kind == ND_FUNCALL) {
+    for (NodeId n = node->body; n; n = node_at(n)->next) fn(n);
+    return;
+  }
+
+  if (node->lhs) fn(node->lhs);
+  if (node->rhs) fn(node->rhs);
+  if (node->kind == ND_IF && node->els) fn(node->els);
+  if (node->kind == ND_FOR) {
+    if (node->init) fn(node->init);
+    if (node->inc) fn(node->inc);
+  }
+}
+
+static void set_type(Node *node);
+
+/*
+  渡されたノードとその子孫に型を付ける関数
+  子に型を付けてから親に付けるので、作業用のスタックに子を積んで辿る
+ */
+void add_type(NodeId id) {
+  // エラーで途中から抜けた場合の残りは捨てる
+  type_stack_len = 0;
+  push_type_work(id);
+
+  while (type_stack_len) {
+    NodeId top = type_stack[type_stack_len - 1];
+    if (top & VISITED) {
+      type_stack_len--;
+      set_type(node_at(top & ~VISITED));
+      continue;
+    }
+
+    Node *node = node_at(top);
+    if (node->ty) {
+      type_stack_len--;
+      continue;
+    }
+    type_stack[type_stack_len - 1] = top | VISITED;
+    visit_children(node, push_type_work);
+  }
+}
+
+// 子の型が付いているノードに型を付ける
+static void set_type(Node *node) {
   switch (node->kind) {
     case ND_ADD:
     case ND_SUB:
-    case ND_PTR_DIFF:
     case ND_MUL:
     case ND_DIV:
+      node->ty = arith_type(node_at(node->lhs)->ty, node_at(node->rhs)->ty);
+      return;
+    case ND_PTR_DIFF:
+      node->ty = long_type;
+      return;
     case ND_EQ:
     case ND_NE:
     case ND_LT:
     case ND_LE:
     case ND_FUNCALL:
-    case ND_NUM:
       node->ty = int_type;
       return;
+    case ND_NUM:
+      node->ty = node->val == (int)node->val ? int_type : long_type;
+      return;
     case ND_PTR_ADD:
     case ND_PTR_SUB:
     case ND_ASSIGN:
-      node->ty = node->lhs->ty;
+      node->ty = node_at(node->lhs)->ty;
       return;
     case ND_VAR:
       node->ty = node->var->ty;
@@ -65,21 +269,24 @@ void add_type(Node *node) {
     case ND_MEMBER:
       node->ty = node->member->ty;
       return;
-    case ND_ADDR:
-      if (node->lhs->ty->kind == TY_ARRAY)
-        node->ty = pointer_to(node->lhs->ty->base);
+    case ND_ADDR: {
+      Type *ty = node_at(node->lhs)->ty;
+      if (ty->kind == TY_ARRAY)
+        node->ty = pointer_to(ty->base);
       else
-        node->ty = pointer_to(node->lhs->ty);
+        node->ty = pointer_to(ty);
       return;
-    case ND_DEREF:
-      if (!node->lhs->ty->base)
-        error_tok(node->tok, "invalid pointer dereference");
-      node->ty = node->lhs->ty->base;
+    }
+    case ND_DEREF: {
+      Type *ty = node_at(node->lhs)->ty;
+      if (!ty->base) error_tok(node->tok, "invalid pointer dereference");
+      node->ty = ty->base;
       return;
+    }
     case ND_STMT_EXPR: {
-      Node *last = node->body;
-      while (last->next) last = last->next;
-      node->ty = last->ty;
+      NodeId last = node->body;
+      while (node_at(last)->next) last = node_at(last)->next;
+      node->ty = node_at(last)->ty;
       return;
     }
   }
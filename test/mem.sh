@@ -0,0 +1,33 @@
+#!/bin/sh
+# 複数の翻訳単位を1回でコンパイルしても、メモリの使用量が単位の数に
+# 比例して増えないかを確かめる。各単位は別の識別子とエスケープを含む
+# 文字列リテラルを持つので、名前やリテラルの領域が捨てられていなければ増える
+set -e
+
+dir=./build/mem
+units=20
+warmup=5 # 表やブロックが行き渡るまでの単位の数
+limit=1024 # warmup個の単位のときより増えてよい量(KiB)
+
+mkdir -p $dir
+for k in $(seq $units); do
+  seq 6000 | awk -v k=$k \
+    '{ printf "int mem%d_%d() { char *s = \"a\\tb\\n%d\"; return s[1]; }\n", k, $1, $1 }' \
+    >$dir/unit$k.c
+done
+
+# `9cc`の引数を受け取り、最大のRSS(KiB)を出力する
+max_rss() {
+  ./build/9cc --mem-stats -o /dev/null "$@" 2>&1 >/dev/null |
+    sed -n 's/^memory: max rss \([0-9]*\) KiB$/\1/p'
+}
+
+for opt in --lex-threads=1 --lex-threads=4; do
+  few=$(max_rss $opt $(seq -f "$dir/unit%g.c" $warmup))
+  all=$(max_rss $opt $(seq -f "$dir/unit%g.c" $units))
+  echo "$opt: $warmup units ${few} KiB, $units units ${all} KiB"
+  if [ $((all - few)) -gt $limit ]; then
+    echo "memory grows with the number of units"
+    exit 1
+  fi
+done